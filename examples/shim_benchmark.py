@@ -0,0 +1,121 @@
+"""
+Runs the shim firmware benchmark ('B', see bench.h) and keeps the results, so timing changes between firmware
+versions show up as numbers instead of guesses.
+Every run is appended to a JSON lines file under a label (a firmware version, or git describe by default).
+With --baseline the run is compared against the newest run of that label, and any entry whose mean got slower by
+more than --threshold percent is reported; the exit status is 1 if there was one.
+Note: the trigger has to be halted, and the currents are zeroed afterwards.
+
+    python shim_benchmark.py --label after-dma --baseline before-dma
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+import serial
+
+
+def load_config(filename):
+    with open(filename, "r") as file:
+        return json.load(file)
+
+
+def git_describe():
+    try:
+        return subprocess.check_output(["git", "describe", "--always", "--dirty"], text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def run_benchmark(port, baudRate, timeout=10):
+    """send 'B' and collect the BENCH lines until Done Benchmark"""
+    results = []
+    with serial.Serial(port, baudRate, timeout=1) as ser:
+        time.sleep(2)  # the teensy resets when the port opens
+        ser.reset_input_buffer()
+        ser.write(b"B")
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            line = ser.readline().decode(errors="replace").strip()
+            if line.startswith("BENCH "):
+                results.append(json.loads(line[len("BENCH ") :]))
+            elif "Done Benchmark" in line:
+                return results
+            elif line:
+                print(line)
+    raise TimeoutError("no Done Benchmark from the shim driver")
+
+
+def key(entry):
+    """entries are told apart by name and their parameters, e.g. tx16 at each divider"""
+    skip = ("n", "min_us", "mean_us", "max_us")
+    return tuple(sorted((k, v) for k, v in entry.items() if k not in skip))
+
+
+def load_run(path, label):
+    """newest run recorded under label, or None"""
+    found = None
+    if os.path.exists(path):
+        with open(path, "r") as file:
+            for line in file:
+                run = json.loads(line)
+                if run["label"] == label:
+                    found = run
+    return found
+
+
+def compare(run, baseline, threshold):
+    """print each entry against the baseline; returns the number slower by more than threshold percent"""
+    before = {key(entry): entry for entry in baseline["results"]}
+    regressions = 0
+    for entry in run["results"]:
+        if "mean_us" not in entry:
+            continue
+        name = ", ".join(f"{k}={v}" for k, v in key(entry))
+        old = before.get(key(entry))
+        if old is None or not old["mean_us"]:
+            print(f"  {name}: {entry['mean_us']:.3f} us (new)")
+            continue
+        change = 100.0 * (entry["mean_us"] - old["mean_us"]) / old["mean_us"]
+        flag = ""
+        if change > threshold:
+            flag = "  <-- REGRESSION"
+            regressions += 1
+        print(f"  {name}: {old['mean_us']:.3f} -> {entry['mean_us']:.3f} us ({change:+.1f}%){flag}")
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--config", default="../config.json")
+    parser.add_argument("--label", default=None, help="name of this run, git describe by default")
+    parser.add_argument("--output", default="shim_benchmark.jsonl", help="file the runs are appended to")
+    parser.add_argument("--baseline", default=None, help="label of the run to compare against")
+    parser.add_argument("--threshold", type=float, default=10.0, help="regression threshold on the mean in percent")
+    args = parser.parse_args()
+
+    config = load_config(args.config)
+    results = run_benchmark(config["shimPort"], config["shimBaudRate"])
+    run = {"label": args.label or git_describe(), "time": time.strftime("%Y-%m-%dT%H:%M:%S"), "results": results}
+    with open(args.output, "a") as file:
+        file.write(json.dumps(run) + "\n")
+    print(f"recorded {len(results)} results as {run['label']} in {args.output}")
+
+    if args.baseline is None:
+        for entry in results:
+            print(json.dumps(entry))
+        return 0
+    baseline = load_run(args.output, args.baseline)
+    if baseline is None:
+        print(f"no run labelled {args.baseline} in {args.output}")
+        return 1
+    regressions = compare(run, baseline, args.threshold)
+    print(f"{regressions} regressions above {args.threshold}% against {args.baseline}")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,248 @@
+/******************************************************/
+/*********************** BENCHMARK ********************/
+/******************************************************/
+
+/* 'B': times the hot paths on the real hardware. Every result is one line
+   BENCH {json} with times in us, the suite ends with "Done Benchmark" and
+   runs in well under a second. examples/shim_benchmark.py collects the runs.
+   Only while the trigger is halted. The raw SPI passes run with nothing
+   selected and the DAC passes write NOPs or zero current rows, so the coils
+   end up zeroed, as after 'Z'. */
+
+#define BENCH_REPS 64
+#define BENCH_WORDS 16
+#define BENCH_TICK_US 100
+#define BENCH_TICKS 1000
+
+typedef struct bench_acc {
+  uint32_t n;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+} bench_acc;
+
+void bench_reset(volatile bench_acc * a) {
+  a->n = 0;
+  a->min = 0xFFFFFFFF;
+  a->max = 0;
+  a->total = 0;
+}
+
+inline void bench_add(volatile bench_acc * a, uint32_t cycles) {
+  a->n++;
+  a->total += cycles;
+  if (cycles < a->min) {
+    a->min = cycles;
+  }
+  if (cycles > a->max) {
+    a->max = cycles;
+  }
+}
+
+float bench_us(uint32_t cycles) {
+  return cycles / float(F_CPU / 1000000);
+}
+
+// extra: more "key":value pairs, already formatted, or ""
+void bench_print(const char * name, const bench_acc * a, const char * extra) {
+  Serial.print("BENCH {\"name\":\"");
+  Serial.print(name);
+  Serial.print("\"");
+  if (extra[0]) {
+    Serial.print(",");
+    Serial.print(extra);
+  }
+  Serial.print(",\"n\":");
+  Serial.print(a->n);
+  Serial.print(",\"min_us\":");
+  Serial.print(a->n ? bench_us(a->min) : 0, 3);
+  Serial.print(",\"mean_us\":");
+  Serial.print(a->n ? bench_us(uint32_t(a->total / a->n)) : 0, 3);
+  Serial.print(",\"max_us\":");
+  Serial.print(bench_us(a->max), 3);
+  Serial.println("}");
+}
+
+// raw tx16 and tx16_burst packets at every DAC clock divider
+void bench_spi() {
+  uint8_t dacDiv = dacClockDiv;
+  uint8_t adcDiv = adcClockDiv;
+  volatile uint16_t words[BENCH_WORDS];
+  for (int i = 0; i < BENCH_WORDS; i++) {
+    words[i] = 0xFFFF;
+  }
+  char extra[48];
+  bench_acc plain;
+  bench_acc burst;
+  selectNone();
+  for (uint8_t div = SPI_CLOCK_DIV2; div <= SPI_CLOCK_DIV128; div++) {
+    spiSetClocks(div, adcDiv);
+    bench_reset(&plain);
+    bench_reset(&burst);
+    for (int r = 0; r < BENCH_REPS / 4; r++) {
+      uint32_t t0 = ARM_DWT_CYCCNT;
+      SPI_MASTER->tx16(words, BENCH_WORDS, CTAR_DAC, 1);
+      bench_add(&plain, ARM_DWT_CYCCNT - t0);
+      t0 = ARM_DWT_CYCCNT;
+      SPI_MASTER->tx16_burst(words, BENCH_WORDS, CTAR_DAC, 1);
+      bench_add(&burst, ARM_DWT_CYCCNT - t0);
+    }
+    snprintf(extra, sizeof(extra), "\"divider\":%d,\"words\":%d", spiClockDivider[div], BENCH_WORDS);
+    bench_print("tx16", &plain, extra);
+    bench_print("tx16_burst", &burst, extra);
+  }
+  spiSetClocks(dacDiv, adcDiv);
+}
+
+// one command frame, then with the settling delay of LTC2656Write
+void bench_dac_write() {
+  bench_acc send;
+  bench_acc write;
+  bench_reset(&send);
+  bench_reset(&write);
+  selectBoard(0);
+  for (int r = 0; r < BENCH_REPS; r++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    LTC2656Send(NOP, DAC_ALL, 0);
+    bench_add(&send, ARM_DWT_CYCCNT - t0);
+  }
+  for (int r = 0; r < BENCH_REPS / 4; r++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    LTC2656Write(NOP, DAC_ALL, 0);
+    bench_add(&write, ARM_DWT_CYCCNT - t0);
+  }
+  bench_print("LTC2656Send", &send, "");
+  bench_print("LTC2656Write", &write, "");
+}
+
+// a whole row for the configured topology, blocking and through the DAC DMA path
+void bench_row() {
+  static uint16_t zeroRow[MAX_B * NUM_C];
+  for (int col = 0; col < channels; col++) {
+    zeroRow[col] = encode_current(0, col);
+  }
+  char extra[48];
+  int groups = wave_groups();
+  snprintf(extra, sizeof(extra), "\"columns\":%d,\"boards\":%d", channels, groups);
+  bench_acc row;
+  bench_reset(&row);
+  for (int r = 0; r < BENCH_REPS; r++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    update_outputs_row(zeroRow, STAT_UPDATE_MAIN);
+    bench_add(&row, ARM_DWT_CYCCNT - t0);
+  }
+  bench_print("update_outputs", &row, extra);
+
+  for (int p = 0; p < groups; p++) {
+    const board_plan * bp = &writePlan[p];
+    int n = min(bp->count, channels - bp->first);
+    dac_dma_build(p, bp->board, bp->dac, n);
+    for (int k = 0; k < n; k++) {
+      dac_dma_code(p, k, zeroRow[bp->first + k]);
+    }
+  }
+  bench_acc cpu;
+  bench_reset(&row);
+  bench_reset(&cpu);
+  for (int r = 0; r < BENCH_REPS && groups > 0; r++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    dac_dma_start(groups);
+    bench_add(&cpu, ARM_DWT_CYCCNT - t0);
+    dac_dma_wait();
+    bench_add(&row, ARM_DWT_CYCCNT - t0);
+  }
+  bench_print("dac_dma_row", &row, extra);
+  bench_print("dac_dma_start", &cpu, extra);
+}
+
+void bench_adc() {
+  bench_acc slow;
+  bench_acc sweep;
+  bench_reset(&slow);
+  bench_reset(&sweep);
+  selectBoard(0);
+  for (int r = 0; r < BENCH_REPS; r++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    LTC1863ReadSlow(0);
+    bench_add(&slow, ARM_DWT_CYCCNT - t0);
+  }
+  bench_print("LTC1863ReadSlow", &slow, "");
+  if (writePlanLength == 0) {
+    return;
+  }
+  const board_plan * bp = &writePlan[0];
+  uint16_t out[NUM_C];
+  selectBoard(bp->board);
+  for (int r = 0; r < BENCH_REPS / 4; r++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    LTC1863ReadSweep(bp->channel, bp->count, out);
+    bench_add(&sweep, ARM_DWT_CYCCNT - t0);
+  }
+  char extra[24];
+  snprintf(extra, sizeof(extra), "\"channels\":%d", bp->count);
+  bench_print("LTC1863ReadSweep", &sweep, extra);
+}
+
+/* Interrupt entry jitter: a PIT at the default priority, the trigger pin's,
+   timestamps its entries; interval spread is the entry jitter */
+IntervalTimer benchTimer;
+volatile bench_acc benchIntervals;
+volatile uint32_t benchLast;
+volatile int benchTicks;
+
+void bench_tick() {
+  uint32_t now = ARM_DWT_CYCCNT;
+  if (benchTicks > 0) {
+    bench_add(&benchIntervals, now - benchLast);
+  }
+  benchLast = now;
+  if (++benchTicks > BENCH_TICKS) {
+    benchTimer.end();
+  }
+}
+
+void bench_jitter() {
+  bench_reset(&benchIntervals);
+  benchTicks = 0;
+  benchTimer.begin(bench_tick, (unsigned)BENCH_TICK_US);
+  while (benchTicks <= BENCH_TICKS) {
+  }
+  bench_acc snap;
+  cli();
+  memcpy(&snap, (const void *)&benchIntervals, sizeof(snap));
+  sei();
+  char extra[24];
+  snprintf(extra, sizeof(extra), "\"period_us\":%d", BENCH_TICK_US);
+  bench_print("isr_interval", &snap, extra);
+}
+
+void bench_run(bool armed) {
+  Serial.println();
+  if (armed) {
+    Serial.println("benchmark needs the trigger halted");
+    Serial.println("Done Benchmark");
+    return;
+  }
+  // the background monitor would share the ADC and the select lines
+  bool monitoring = telemetryActive;
+  telemetry_run(false);
+  wave_stop();
+  Serial.print("BENCH {\"name\":\"info\",\"build\":\"" __DATE__ " " __TIME__ "\",\"f_cpu\":");
+  Serial.print(F_CPU);
+  Serial.print(",\"f_bus\":");
+  Serial.print(F_BUS);
+  Serial.print(",\"boards\":");
+  Serial.print(numBoards);
+  Serial.print(",\"columns\":");
+  Serial.print(numColumns);
+  Serial.println("}");
+  bench_spi();
+  bench_dac_write();
+  bench_row();
+  bench_adc();
+  bench_jitter();
+  zero_all();
+  selectNone();
+  telemetry_run(monitoring);
+  Serial.println("Done Benchmark");
+}
@@ -1,7 +1,9 @@
 #include "t3spi.h"
+#include "stats.h"
+#include "ring.h"
 
-#define NUM_B 1//number of boards
-#define NUM_C 8//number of channels per board
+#define MAX_B 8//boards the three select lines can address
+#define NUM_C 8//number of channels per board (LTC2656 outputs)
 
 typedef enum LTC26456_COMMAND {
   WRITE_TO_INPUT             = 0x00,
@@ -29,29 +31,37 @@ typedef enum LTC2656_ADDRESS {
 } LTC2656_ADDRESS;
 
 
+// each device gets its own CTAR so the DAC can be clocked faster than the ADC
+#define CTAR_DAC CTAR_MODE0
+#define CTAR_ADC CTAR_MODE1
+uint8_t dacClockDiv = SPI_CLOCK_DIV4;
+uint8_t adcClockDiv = SPI_CLOCK_DIV16;
+
 T3SPI * SPI_MASTER;
 T3SPI * SPI_SLAVE;
 //communication buffers
 volatile uint16_t data_tx[20] = {};
 volatile uint8_t data_tx_8[20] = {};
-volatile uint16_t data_rx[20] = {};
-bool read_in_flight;
-// volatile uint8_t data_rx[20] = {};
+
+typedef enum adc_state {ADC_IDLE, ADC_RUNNING, ADC_DONE, ADC_TIMEOUT} adc_state;
+volatile adc_state adcState = ADC_IDLE;
 //const bool bncOut = false;
 const bool bncOut = true;
 
 
 LTC2656_ADDRESS channelMap[] = {DAC_E, DAC_F, DAC_G, DAC_H, DAC_A, DAC_B, DAC_C, DAC_D};
 uint8_t channelMap_ADC[] = {0, 4, 1, 5, 2, 6, 3, 7};
-const int boardMap[NUM_B] = {2};//{3,4,5,6};//{3,2,1,0};   % new board map feb 2020,  6-->0,  5-->1,  4-->2,  3-->3
-//const int boardMap[NUM_B] = {3};//{3,4,5,6};
+// runtime topology, replaced by CMD_SET_TOPOLOGY (see TOPOLOGY in util.h)
+int numBoards = 1;
+int boardMap[MAX_B] = {2};// select line address of each board,  new board map feb 2020,  6-->0,  5-->1,  4-->2,  3-->3
 
 
-float zeroPoint[NUM_B][NUM_C];
-float gain[NUM_B][NUM_C];
-bool calibrationStatus[NUM_B][NUM_C];
-int8_t channel_order[NUM_B * NUM_C];
-int8_t board_order[NUM_B * NUM_C];
+float zeroPoint[MAX_B][NUM_C];
+float gain[MAX_B][NUM_C];
+uint16_t zeroCode[MAX_B][NUM_C]; // code of 0 A for the calibration above, see zero_codes_update()
+bool calibrationStatus[MAX_B][NUM_C];
+int8_t channel_order[MAX_B * NUM_C];
+int8_t board_order[MAX_B * NUM_C];
 
 // these output currents are not used anymore
 const int loopsize = 2;
@@ -72,6 +82,7 @@ void selectADC(void);
 void selectError(void);
 void selectBoard(int board);
 void spiInit(void);
+bool spiSetClocks(uint8_t dacDiv, uint8_t adcDiv);
 
 
 
@@ -79,8 +90,16 @@ void LTC2656Write(T3SPI * SPIx
                   , LTC26456_COMMAND action
                   , LTC2656_ADDRESS address
                   , uint16_t value);
+void LTC2656Send(LTC26456_COMMAND action, LTC2656_ADDRESS address, uint16_t value);
+void LTC2656Stage(LTC2656_ADDRESS address, uint16_t value);
+void LTC2656Latch(void);
+void dac_zero_boards(void);
+void dac_dma_wait(void);
+bool dac_dma_start(uint8_t groups);
 
 uint16_t LTC1863ReadSlow(T3SPI * SPIx, uint8_t address);
+bool LTC1863ReadSweep(const uint8_t * addresses, uint8_t n, uint16_t * out);
+bool LTC1863ReadOversampled(const uint8_t * addresses, uint8_t n, uint8_t count, uint16_t * out);
 /******************************************************/
 /*********************** SELECTION UTIL* **************/
 /******************************************************/
@@ -93,6 +112,7 @@ const int boardSelect0 = 18;
 const int interruptPin = 6;
 const int bncPin = 4;
 const int CS_BB = 30;
+volatile int currentBoard = 0;
 
 void initIO() {
   pinMode(selectPin0, OUTPUT);
@@ -105,12 +125,62 @@ void initIO() {
   digitalWrite(CS_BB,1);
   if (bncOut){
    pinMode(bncPin,OUTPUT);
+   digitalWrite(bncPin,LOW);
   } else {
    pinMode(bncPin,INPUT);
   }
 
 }
 
+/******************************************************/
+/*********************** BNC SYNC *********************/
+/******************************************************/
+
+/* Sync pulse on bncPin, bncDelayUs after the DAC latch and bncWidthUs wide,
+   timed by a one-shot PIT so it is µs accurate and always ends. A trigger
+   that arrives while a pulse is pending restarts it. Width 0 disables it */
+IntervalTimer bncTimer;
+volatile uint16_t bncDelayUs = 0;
+volatile uint16_t bncWidthUs = 13;
+
+void bnc_fall() {
+  bncTimer.end();
+  digitalWriteFast(bncPin, LOW);
+}
+
+void bnc_rise() {
+  bncTimer.end();
+  digitalWriteFast(bncPin, HIGH);
+  bncTimer.begin(bnc_fall, (unsigned)bncWidthUs);
+}
+
+// call right after the latch
+void bnc_pulse() {
+  if (!bncOut || bncWidthUs == 0) {
+    return;
+  }
+  bncTimer.end();
+  if (bncDelayUs == 0) {
+    bnc_rise();
+  } else {
+    digitalWriteFast(bncPin, LOW);
+    bncTimer.begin(bnc_rise, (unsigned)bncDelayUs);
+  }
+}
+
+bool bncSetTiming(uint16_t delayUs, uint16_t widthUs) {
+  if (!bncOut && widthUs != 0) {
+    return false;
+  }
+  cli();
+  bncTimer.end();
+  digitalWriteFast(bncPin, LOW);
+  bncDelayUs = delayUs;
+  bncWidthUs = widthUs;
+  sei();
+  return true;
+}
+
 void spiInit() {
   //SETUP digital COMS
   SPI_MASTER = new T3SPI(&KINETISK_SPI0);
@@ -119,11 +189,24 @@ void spiInit() {
   SPI_MASTER->begin_MASTER(SCK, MOSI, MISO, CS0, CS_ActiveLOW);
   SPI_SLAVE->begin_SLAVE(SCK, MOSI, MISO, CS0);
 
-  SPI_MASTER->setCTAR(CTAR_MODE0, 16, SPI_MODE0, LSB_FIRST, SPI_CLOCK_DIV16);
-  //  SPI_MASTER->setCTAR(CTAR_MODE1, 8, SPI_MODE0, LSB_FIRST, SPI_CLOCK_DIV16);
+  spiSetClocks(dacClockDiv, adcClockDiv);
   SPI_SLAVE->setCTAR_SLAVE(16, SPI_MODE1);
 }
 
+// dividers are SPI_CLOCK_DIV2 .. SPI_CLOCK_DIV128, can be changed at runtime
+bool spiSetClocks(uint8_t dacDiv, uint8_t adcDiv) {
+  if (dacDiv > SPI_CLOCK_DIV128 || adcDiv > SPI_CLOCK_DIV128) {
+    return false;
+  }
+  cli();
+  dacClockDiv = dacDiv;
+  adcClockDiv = adcDiv;
+  SPI_MASTER->setCTAR(CTAR_DAC, 16, SPI_MODE0, LSB_FIRST, dacClockDiv);
+  SPI_MASTER->setCTAR(CTAR_ADC, 16, SPI_MODE0, LSB_FIRST, adcClockDiv);
+  sei();
+  return true;
+}
+
 void selectNone() {
   digitalWrite(selectPin0, HIGH);
   digitalWrite(selectPin1, HIGH);
@@ -147,6 +230,7 @@ void selectError() {
 }
 
 void selectBoard(int board) {
+  currentBoard = board;
   int b = boardMap[board];
   digitalWrite(boardSelect0, b & 0x01);
   digitalWrite(boardSelect1, b & 0x02);
@@ -155,65 +239,433 @@ void selectBoard(int board) {
 
 
 
-void LTC2656Write(LTC26456_COMMAND action, LTC2656_ADDRESS address, uint16_t value) {
-  cli();
+/* Set by the emergency zero (EMERGENCY ZERO in shim_arduino.ino): writes are
+   dropped until the host's next command, so a row or command the zero
+   interrupted half way does not drive the coils again when it resumes */
+volatile bool dacHold = false;
+
+// one command frame, interrupts off
+void dac_frame(LTC26456_COMMAND action, LTC2656_ADDRESS address, uint16_t value) {
+  uint32_t t0 = stat_begin();
+  // keep the readback slave deaf so DAC words don't land in an ADC sweep
+  if (adcState == ADC_RUNNING) {
+    digitalWrite(CS_BB,1);
+  }
   selectNone();
   selectDAC();
   data_tx[0] = ((action | address) & 0xFF);
   data_tx[1] = ((value >> 8) & 0xFF) << 8;
   data_tx[1] |= (value & 0xFF);
-  SPI_MASTER->tx16(data_tx, 2, CTAR_MODE0, 1);
+  SPI_MASTER->tx16_burst(data_tx, 2, CTAR_DAC, 1); // CS held across both words
   selectNone();
+  if (adcState == ADC_RUNNING) {
+    digitalWrite(CS_BB,0);
+  }
+  stat_end(STAT_DAC_SEND, t0);
+}
+
+// single command frame, no settling delay
+void LTC2656Send(LTC26456_COMMAND action, LTC2656_ADDRESS address, uint16_t value) {
+  dac_dma_wait();
+  cli();
+  if (!dacHold) {
+    dac_frame(action, address, value);
+  }
   sei();
+}
+
+void LTC2656Write(LTC26456_COMMAND action, LTC2656_ADDRESS address, uint16_t value) {
+  LTC2656Send(action, address, value);
    delayMicroseconds(100);
 }
 
-uint16_t LTC1863ReadSlow(uint8_t address) {
-  read_in_flight = true;
-  NVIC_ENABLE_IRQ(IRQ_SPI1);
+/* Staged update: load input registers back to back with LTC2656Stage, then
+   move every input register of the selected board to its output at once */
+void LTC2656Stage(LTC2656_ADDRESS address, uint16_t value) {
+  LTC2656Send(WRITE_TO_INPUT, address, value);
+}
+
+void LTC2656Latch() {
+  LTC2656Send(UPDATE_DAC, DAC_ALL, 0);
+}
+
+// stage zeroCode on every channel and latch each board at once; interrupts off, no DMA chain in flight
+void dac_zero_boards() {
+  int board = currentBoard;
+  for (int b = 0; b < numBoards; b++) {
+    selectBoard(b);
+    for (int c = 0; c < NUM_C; c++) {
+      dac_frame(WRITE_TO_INPUT, channelMap[c], zeroCode[b][c]);
+    }
+    dac_frame(UPDATE_DAC, DAC_ALL, 0);
+  }
+  selectBoard(board);
+}
+
+/******************************************************/
+/*********************** DAC DMA **********************/
+/******************************************************/
+
+/* Row writes that do not wait on the SPI. Every board's staged writes and
+   latch are a prebuilt PUSHR image (one frame of 2 words per command) sent
+   by DMA; the completion interrupt selects the next board and starts its
+   image, so the CPU only pays for the board switches. While a chain is in
+   flight the ADC engine holds its transactions and LTC2656Send waits */
+#define DAC_DMA_WORDS (2 * (NUM_C + 1))
+
+volatile uint32_t dacDmaImage[MAX_B][DAC_DMA_WORDS];
+uint8_t dacDmaLength[MAX_B];     // words of each board's image
+int8_t dacDmaBoard[MAX_B];
+uint8_t dacDmaGroups = 0;
+volatile uint8_t dacDmaNext = 0;
+volatile bool dacDmaBusy = false;
+int dacDmaRestore;      // board selected before the chain
+
+// SPI_CLOCK_DIVn code -> divider
+const uint8_t spiClockDivider[] = {2, 4, 6, 8, 16, 32, 64, 128};
+
+inline uint32_t dac_pushr(uint16_t word, bool cont) {
+  return SPI_PUSHR_16(word, CTAR_DAC, 1) | (cont ? SPI_PUSHR_CONT : 0);
+}
+
+// image g stages n channels of board and latches them
+void dac_dma_build(int g, int8_t board, const LTC2656_ADDRESS * dac, int n) {
+  volatile uint32_t * w = dacDmaImage[g];
+  for (int k = 0; k < n; k++) {
+    w[2 * k] = dac_pushr((WRITE_TO_INPUT | dac[k]) & 0xFF, true);
+    w[2 * k + 1] = dac_pushr(0, false);
+  }
+  w[2 * n] = dac_pushr((UPDATE_DAC | DAC_ALL) & 0xFF, true);
+  w[2 * n + 1] = dac_pushr(0, false);
+  dacDmaBoard[g] = board;
+  dacDmaLength[g] = 2 * (n + 1);
+}
+
+// code of the k-th staged channel of image g
+inline void dac_dma_code(int g, int k, uint16_t code) {
+  dacDmaImage[g][2 * k + 1] = dac_pushr(code, false);
+}
+
+// runs from the DMA completion interrupt
+void dac_dma_next() {
   selectNone();
-  selectADC();
-  digitalWrite(CS_BB,0);
-  data_tx[0] = ((0x80 | ((channelMap_ADC[address] << 4)) | 0x04) << 8) | (0x00);;
-  SPI_MASTER->tx16(data_tx, 1, CTAR_MODE0, CS0);
-  selectNone(); //toggle CS line to initialize the conversion
-  delayMicroseconds(20); //wait the conversion time
+  if (dacDmaNext >= dacDmaGroups) {
+    selectBoard(dacDmaRestore);
+    if (adcState == ADC_RUNNING) {
+      digitalWrite(CS_BB,0);
+    }
+    dacDmaBusy = false;
+    return;
+  }
+  uint8_t g = dacDmaNext++;
+  selectBoard(dacDmaBoard[g]);
+  selectDAC();
+  // txPUSHR_dma marks the end of queue on the last word, the latch's data word
+  SPI_MASTER->txPUSHR_dma(dacDmaImage[g], dacDmaLength[g], dac_dma_next);
+}
+
+// send images 0 .. groups-1; false if the previous chain is still in flight
+bool dac_dma_start(uint8_t groups) {
+  if (dacDmaBusy || dacHold || groups == 0) {
+    return false;
+  }
+  dacDmaBusy = true;
+  dacDmaGroups = groups;
+  dacDmaNext = 0;
+  dacDmaRestore = currentBoard;
+  if (adcState == ADC_RUNNING) {
+    digitalWrite(CS_BB,1);
+  }
+  dac_dma_next();
+  return true;
+}
+
+// drop the rest of a chain, from an interrupt that outranks the DMA's
+void dac_dma_abort() {
+  if (!dacDmaBusy) {
+    return;
+  }
+  SPI_MASTER->abortDMA();
+  dacDmaNext = dacDmaGroups;
+  selectNone();
+  selectBoard(dacDmaRestore);
+  if (adcState == ADC_RUNNING) {
+    digitalWrite(CS_BB,0);
+  }
+  dacDmaBusy = false;
+}
+
+// only from contexts below the DMA and SPI0 interrupt priority
+void dac_dma_wait() {
+  while (dacDmaBusy) {
+  }
+}
 
+// wire time in us of a row of columns spread over groups boards, with select overhead
+unsigned dac_dma_row_us(int columns, int groups) {
+  uint32_t bits = 32UL * (columns + groups);
+  return bits * spiClockDivider[dacClockDiv] / (F_BUS / 1000000) + 3 * groups + 1;
+}
+
+/******************************************************/
+/*********************** ADC ENGINE *******************/
+/******************************************************/
+
+/* LTC1863 reads are pipelined: the command word clocked in while conversion
+   N is clocked out selects the channel of conversion N+1, so a sweep of n
+   channels costs n+1 transactions instead of 2n. adcTimer paces one transaction
+   per conversion time, spi1_isr pushes every slave word into adcRing and
+   adc_poll() drains it into adcResults from the main loop. */
+
+#define ADC_MAX_SWEEP 64
+#define ADC_RING_SIZE 128 // power of two
+#define ADC_CLAIM_US 5000 // longer than the longest sweep
+
+IntervalTimer adcTimer;
+uint8_t adcConvUs = 20; // conversion wait between transactions
+uint8_t adcSweep[ADC_MAX_SWEEP];
+uint16_t adcResults[ADC_MAX_SWEEP];
+volatile uint16_t adc_tx[1];
+spsc_ring<uint16_t, ADC_RING_SIZE> adcRing; // spi1_isr -> adc_poll
+volatile uint8_t adcSweepLen;
+volatile uint8_t adcIssued;
+volatile uint8_t adcReceived;
+uint8_t adcCollected;
+int adcBoard;
+unsigned long adcStartUs;
+unsigned long adcTimeoutUs;
+unsigned long adcTimeouts = 0;
+
+// one pipelined transaction; runs from adcTimer
+void adc_tick() {
+  if (adcState != ADC_RUNNING || adcIssued > adcSweepLen) {
+    adcTimer.end();
+    return;
+  }
+  // a DAC DMA chain owns the select lines, the next tick tries again
+  if (dacDmaBusy) {
+    return;
+  }
+  // the trigger interrupt may have switched boards since the last tick, and
+  // the main loop may be between selecting a board and writing to it. The
+  // emergency zero outranks this timer, so the transaction runs with
+  // interrupts off like a DAC frame
+  cli();
+  int board = currentBoard;
+  selectBoard(adcBoard);
+  // the last transaction only clocks out the final result
+  uint8_t address = adcSweep[(adcIssued < adcSweepLen) ? adcIssued : adcSweepLen - 1];
   selectNone();
   selectADC();
-  data_tx[0] = ((0x80 | ((address << 4)) | 0x04) << 8) | (0x00);;
-  SPI_MASTER->tx16(data_tx, 1, CTAR_MODE0, CS0);
-  while (SPI_SLAVE->packetCT == 0) {
+  adc_tx[0] = ((0x80 | ((channelMap_ADC[address] << 4)) | 0x04) << 8) | (0x00);
+  SPI_MASTER->tx16(adc_tx, 1, CTAR_ADC, CS0);
+  selectNone(); //toggle CS line to initialize the conversion
+  selectBoard(board);
+  sei();
+  adcIssued++;
+  if (adcIssued > adcSweepLen) {
+    adcTimer.end();
+  }
+}
 
+/* Start a non-blocking sweep of ADC channels on board (default: the selected
+   one). Poll with adc_poll() until it leaves ADC_RUNNING, then hand the engine
+   back with adcState = ADC_IDLE. The engine is claimed atomically so the
+   background loop and the main loop never share a sweep */
+bool adc_start(const uint8_t * addresses, uint8_t n, int board = -1) {
+  if (n == 0 || n > ADC_MAX_SWEEP) {
+    return false;
   }
-  digitalWrite(CS_BB,1);
-  read_in_flight = false;
-  NVIC_DISABLE_IRQ(IRQ_SPI1);
+  cli();
+  bool busy = (adcState != ADC_IDLE);
+  if (!busy) {
+    adcState = ADC_RUNNING; // adc_tick() only runs once the timer starts below
+  }
+  sei();
+  if (busy) {
+    return false;
+  }
+  memcpy(adcSweep, addresses, n);
+  adcSweepLen = n;
+  adcIssued = 0;
+  adcReceived = 0;
+  adcCollected = 0;
+  adcRing.clear();
+  adcBoard = (board < 0) ? currentBoard : board;
   SPI_SLAVE->packetCT = 0;
   SPI_SLAVE->dataPointer = 0;
-  selectNone(); //toggle CS line to initialize the conversion
+  adcStartUs = micros();
+  adcTimeoutUs = (unsigned long)(n + 1) * (adcConvUs + 20) + 500;
+  digitalWrite(CS_BB,0);
+  NVIC_ENABLE_IRQ(IRQ_SPI1);
+  adcTimer.begin(adc_tick, (unsigned)adcConvUs + 6);
+  return true;
+}
 
-//  return (~data_rx[1]&0xFFFF)>>4; // 74HCT244
-  return (data_rx[1]&0xFFFF)>>4; // 74HCT240
+// move received words into adcResults, finish or time out the sweep
+adc_state adc_poll() {
+  uint16_t w;
+  while (adcRing.pop(w)) {
+    // the first word clocks out a conversion from before the sweep
+    if (adcCollected > 0 && adcCollected <= adcSweepLen) {
+//      adcResults[adcCollected - 1] = (~w&0xFFFF)>>4; // 74HCT244
+      adcResults[adcCollected - 1] = (w&0xFFFF)>>4; // 74HCT240
+    }
+    adcCollected++;
+  }
+  if (adcState == ADC_RUNNING) {
+    if (adcCollected > adcSweepLen) {
+      adcState = ADC_DONE;
+    } else if (micros() - adcStartUs > adcTimeoutUs) {
+      adcTimer.end();
+      adcTimeouts++;
+      adcState = ADC_TIMEOUT;
+    }
+    if (adcState != ADC_RUNNING) {
+      digitalWrite(CS_BB,1);
+      NVIC_DISABLE_IRQ(IRQ_SPI1);
+      selectNone();
+    }
+  }
+  return adcState;
 }
 
-uint16_t LTC1863ReadSlow(uint8_t address, uint8_t n) {
-  n = 1;
-  uint32_t avg = 0;
+adc_state adc_wait() {
+  while (adc_poll() == ADC_RUNNING) {
+  }
+  return adcState;
+}
+
+/* Blocking sweep; out[i] is the reading of addresses[i].
+   Returns false (and leaves out untouched) if the slave never answered */
+bool LTC1863ReadSweep(const uint8_t * addresses, uint8_t n, uint16_t * out) {
+  // the background loop may own the engine for one sweep, wait it out
+  unsigned long t0 = micros();
+  while (!adc_start(addresses, n)) {
+    if (micros() - t0 > ADC_CLAIM_US) {
+      return false;
+    }
+  }
+  if (adc_wait() != ADC_DONE) {
+    adcState = ADC_IDLE;
+    return false;
+  }
+  memcpy(out, adcResults, n * sizeof(uint16_t));
+  adcState = ADC_IDLE;
+  return true;
+}
+
+uint16_t LTC1863ReadSlow(uint8_t address) {
+  uint16_t data = 0;
+  LTC1863ReadSweep(&address, 1, &data);
+  return data;
+}
+
+/******************************************************/
+/*********************** OVERSAMPLING *****************/
+/******************************************************/
+
+#define ADC_MAX_OVERSAMPLE 64
+
+typedef enum adc_filter {
+  ADC_FILTER_BOXCAR  = 0, // plain mean
+  ADC_FILTER_MEDIAN  = 1,
+  ADC_FILTER_TRIMMED = 2  // mean of the middle half
+} adc_filter;
+
+adc_filter adcFilter = ADC_FILTER_TRIMMED;
+uint8_t adcOversample = 0; // when non zero overrides the count asked for by callers
+uint16_t adcSamples[NUM_C][ADC_MAX_OVERSAMPLE];
+
+void sort_samples(uint16_t * x, int n) {
+  for (int i = 1; i < n; i++) {
+    uint16_t v = x[i];
+    int j = i - 1;
+    while (j >= 0 && x[j] > v) {
+      x[j + 1] = x[j];
+      j--;
+    }
+    x[j + 1] = v;
+  }
+}
+
+uint16_t adc_decimate(uint16_t * x, int n, adc_filter filter) {
+  int lo = 0;
+  int hi = n;
+  if (filter != ADC_FILTER_BOXCAR) {
+    sort_samples(x, n);
+    if (filter == ADC_FILTER_MEDIAN) {
+      return (n % 2) ? x[n / 2] : uint16_t((uint32_t(x[n / 2 - 1]) + x[n / 2]) / 2);
+    }
+    lo = n / 4;
+    hi = n - n / 4;
+  }
+  uint32_t sum = 0;
+  for (int i = lo; i < hi; i++) {
+    sum += x[i];
+  }
+  return uint16_t(sum / (hi - lo));
+}
+
+/* count samples of every address, interleaved so the pipeline never idles,
+   decimated with adcFilter into out[i]. Returns false on an ADC timeout */
+bool LTC1863ReadOversampled(const uint8_t * addresses, uint8_t n, uint8_t count, uint16_t * out) {
+  if (adcOversample != 0) {
+    count = adcOversample;
+  }
+  if (n == 0 || n > NUM_C) {
+    return false;
+  }
+  count = constrain(count, 1, ADC_MAX_OVERSAMPLE);
+  uint32_t t0 = stat_begin();
+  uint8_t sweep[ADC_MAX_SWEEP];
+  uint16_t data[ADC_MAX_SWEEP];
+  int perSweep = ADC_MAX_SWEEP / n; // samples of each address per sweep
+  for (int taken = 0; taken < count; taken += perSweep) {
+    int reps = min(perSweep, count - taken);
+    int len = 0;
+    for (int r = 0; r < reps; r++) {
+      for (int i = 0; i < n; i++) {
+        sweep[len++] = addresses[i];
+      }
+    }
+    if (!LTC1863ReadSweep(sweep, len, data)) {
+      return false;
+    }
+    for (int r = 0; r < reps; r++) {
+      for (int i = 0; i < n; i++) {
+        adcSamples[i][taken + r] = data[r * n + i];
+      }
+    }
+  }
   for (int i = 0; i < n; i++) {
-    avg += LTC1863ReadSlow(address);
+    out[i] = adc_decimate(adcSamples[i], count, adcFilter);
+  }
+  stat_end(STAT_ADC_READ, t0);
+  return true;
+}
+
+uint16_t LTC1863ReadSlow(uint8_t address, uint8_t n) {
+  uint16_t data = 0;
+  LTC1863ReadOversampled(&address, 1, n, &data);
+  return data;
+}
+
+bool adcSetFilter(uint8_t filter, uint8_t count) {
+  if (filter > ADC_FILTER_TRIMMED || count > ADC_MAX_OVERSAMPLE) {
+    return false;
   }
-  return uint16_t(avg / n);
+  adcFilter = (adc_filter)filter;
+  adcOversample = count;
+  return true;
 }
 
 //Interrupt Service Routine to handle incoming data
 void spi1_isr(void) {
-  cli();
-  if (read_in_flight) {
-    SPI_SLAVE->rx16(data_rx, 2);
-  } else {
-    uint16_t dump;
-    SPI_SLAVE->rx16(&dump, 1);
+  volatile uint16_t data;
+  SPI_SLAVE->rx16(&data, 1);
+  if (adcState == ADC_RUNNING) {
+    adcRing.push(uint16_t(data));
+    adcReceived++;
   }
-  sei();
 }
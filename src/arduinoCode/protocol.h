@@ -0,0 +1,265 @@
+/******************************************************/
+/*************** BINARY FRAMED PROTOCOL ***************/
+/******************************************************/
+
+// Host -> device frame (multi byte fields are little endian):
+//   [FRAME_SYNC][len lo][len hi][seq][cmd][payload: len bytes][crc lo][crc hi]
+// crc is CRC-16/CCITT (poly 0x1021, init 0xFFFF) over len, seq, cmd and payload.
+// Everything after FRAME_SYNC is stuffed (ZERO_STUFF below), len and crc are of
+// the frame before stuffing.
+// Every frame is answered with [FRAME_ACK][seq] or [FRAME_NAK][seq][error].
+// Commands that return data answer with a frame of their own instead of the
+// ACK: [FRAME_REPLY][len lo][len hi][seq][cmd][payload][crc lo][crc hi], crc
+// computed the same way. Unsolicited events use the same layout behind
+// FRAME_EVENT with seq 0 and a frame_event_id as cmd.
+// None of these bytes are printable so the host can tell them apart from the
+// ASCII replies of the fallback command set.
+
+#define FRAME_SYNC          0xA5
+#define FRAME_ACK           0x06
+#define FRAME_NAK           0x15
+#define FRAME_REPLY         0x02
+#define FRAME_EVENT         0x03
+#define FRAME_MAX_PAYLOAD   512
+#define FRAME_TIMEOUT_MS    100
+
+// Between commands the single ZERO_BYTE zeroes every coil (EMERGENCY ZERO in
+// shim_arduino.ino). Inside a frame or an upload stream any byte may be data,
+// so there it takes a run of ZERO_RUN of them: the host always sends the run.
+// Data never makes one, after ZERO_RUN - 1 ZERO_BYTEs in a row the host puts
+// a ZERO_STUFF before the next byte of the frame or stream, dropped here. The
+// legacy float table is not stuffed, its run is four currents of 2e-24 A
+#define ZERO_BYTE           0x18 // ASCII CAN: no ascii command, not FRAME_SYNC
+#define ZERO_RUN            16
+#define ZERO_STUFF          0x00
+
+typedef enum frame_command {
+  CMD_PING            = 0x00,
+  CMD_SET_CURRENTS    = 0x01, // [n] then n x [board][channel][float32 current]
+  CMD_ZERO            = 0x02,
+  CMD_SET_SPI_CLOCK   = 0x03, // [dac divider][adc divider], SPI_CLOCK_DIVn codes
+  CMD_SET_ADC_FILTER  = 0x04, // [adc_filter][sample count, 0 = callers choose]
+  CMD_UPLOAD_BEGIN    = 0x05, // [format][channels][blocks][u16 lengths x blocks][u32 reps x blocks][UPLOAD_CODES: u16 epoch][optional u16 stored rows][u8 index size]
+  CMD_UPLOAD_CHUNK    = 0x06, // [u16 value offset][values]
+  CMD_UPLOAD_END      = 0x07, // [optional hold: 1 = wait for CMD_TABLE_COMMIT]
+  CMD_TABLE_COMMIT    = 0x08, // swap in the uploaded table at the next trigger
+  CMD_SET_TOPOLOGY    = 0x09, // [boards] then per board [address][n][channel x n]
+  CMD_SET_REGULATION  = 0x0A, // [enable][float32 integral gain], runs while armed
+  CMD_SET_BNC         = 0x0B, // [u16 delay us][u16 width us] of the sync pulse, width 0 = off
+  CMD_GET_STATS       = 0x0C, // [optional reset: 1 = clear after reading], replies with stats_pack()
+  CMD_SET_TRIGGER     = 0x0D, // [trigger_policy][max queued rows before skipping]
+  CMD_UPLOAD_BULK     = 0x0E, // [u32 bytes][u16 crc], the raw value stream follows the ACK
+  CMD_LINK_INFO       = 0x0F, // replies [u8 usb][u32 baud][u16 max payload][u16 bulk block]
+  CMD_GET_CALIBRATION = 0x10, // [first column], replies with calibration_pack()
+  CMD_SET_RAMP        = 0x11, // [ramp][points] then per point [u16 ticks][int16 code offset x channels]
+  CMD_SET_WAVEFORM    = 0x12, // [u16 tick us, 0 = off][blocks][ramp + 1 x blocks, 0 = static]
+  CMD_SET_TELEMETRY   = 0x13, // [u16 period ms, 0 = off] of the background current monitor
+  CMD_SET_EMERGENCY   = 0x14  // [enable] the emergency zero pin, kept in EEPROM
+} frame_command;
+
+typedef enum frame_error {
+  ERR_NONE            = 0x00,
+  ERR_CRC             = 0x01,
+  ERR_LENGTH          = 0x02,
+  ERR_TIMEOUT         = 0x03,
+  ERR_UNKNOWN_CMD     = 0x04,
+  ERR_BAD_ARG         = 0x05,
+  ERR_TOO_BIG         = 0x06,
+  ERR_SEQUENCE        = 0x07
+} frame_error;
+
+typedef enum frame_event_id {
+  EVT_DESYNC          = 0x80, // [u32 edge][u16 late rows][u8 queued 0 / skipped 1][u32 events so far]
+  EVT_TRIGGER_LOG     = 0x81, // [n][u32 dropped] then n trigger records, see send_trigger_log()
+  EVT_TELEMETRY       = 0x82, // one monitoring round, see telemetry_pack()
+  EVT_ZERO            = 0x83  // [u8 zero_source][u32 emergency zeroes so far]
+} frame_event_id;
+
+typedef enum frame_state {
+  FRAME_LEN_LO, FRAME_LEN_HI, FRAME_SEQ, FRAME_CMD,
+  FRAME_PAYLOAD, FRAME_CRC_LO, FRAME_CRC_HI, FRAME_DONE
+} frame_state;
+
+frame_state frameState;
+uint8_t frameBuffer[FRAME_MAX_PAYLOAD];
+uint16_t frameLength;
+uint16_t frameIdx;
+uint8_t frameSeq;
+uint8_t frameCmd;
+uint16_t frameCrc;
+uint16_t frameCrcRx;
+frame_error frameError;
+unsigned long frameStart;
+bool frameHostSeen = false; // a valid frame has arrived, the host decodes binary replies
+
+uint16_t crc16_update(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t)data << 8;
+  for (int i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  }
+  return crc;
+}
+
+uint16_t crc16(const uint8_t * data, int len, uint16_t crc = 0xFFFF) {
+  for (int i = 0; i < len; i++) {
+    crc = crc16_update(crc, data[i]);
+  }
+  return crc;
+}
+
+void frame_ack(uint8_t seq) {
+  uint8_t reply[2] = {FRAME_ACK, seq};
+  Serial.write(reply, 2);
+}
+
+void frame_nak(uint8_t seq, frame_error err) {
+  uint8_t reply[3] = {FRAME_NAK, seq, (uint8_t)err};
+  Serial.write(reply, 3);
+}
+
+void frame_send(uint8_t marker, uint8_t seq, uint8_t cmd, const uint8_t * payload, uint16_t len) {
+  uint8_t head[5] = {marker, uint8_t(len & 0xFF), uint8_t(len >> 8), seq, cmd};
+  uint16_t crc = crc16(head + 1, 4);
+  crc = crc16(payload, len, crc);
+  uint8_t tail[2] = {uint8_t(crc & 0xFF), uint8_t(crc >> 8)};
+  Serial.write(head, 5);
+  Serial.write(payload, len);
+  Serial.write(tail, 2);
+}
+
+void frame_reply(uint8_t seq, uint8_t cmd, const uint8_t * payload, uint16_t len) {
+  frame_send(FRAME_REPLY, seq, cmd, payload, len);
+}
+
+void frame_event(frame_event_id evt, const uint8_t * payload, uint16_t len) {
+  frame_send(FRAME_EVENT, 0, evt, payload, len);
+}
+
+uint8_t zeroRun = 0;
+bool zeroRunSeen = false; // latched for loop(), which zeroes and drops what it was reading
+
+// count ZERO_BYTEs through binary input, true once a run of them has come in
+bool zero_run_scan(const uint8_t * p, int n) {
+  for (int i = 0; i < n && !zeroRunSeen; i++) {
+    zeroRun = (p[i] == ZERO_BYTE) ? zeroRun + 1 : 0;
+    zeroRunSeen = (zeroRun >= ZERO_RUN);
+  }
+  return zeroRunSeen;
+}
+
+// zero_run_scan for stuffed input: drops the ZERO_STUFFs in place, returns the data bytes left
+int zero_run_unstuff(uint8_t * p, int n) {
+  int kept = 0;
+  for (int i = 0; i < n && !zeroRunSeen; i++) {
+    if (zeroRun == ZERO_RUN - 1 && p[i] == ZERO_STUFF) {
+      zeroRun = 0;
+      continue;
+    }
+    zeroRun = (p[i] == ZERO_BYTE) ? zeroRun + 1 : 0;
+    zeroRunSeen = (zeroRun >= ZERO_RUN);
+    p[kept++] = p[i];
+  }
+  return kept;
+}
+
+// call once the FRAME_SYNC byte has been consumed
+void frame_begin() {
+  zeroRun = 0;
+  frameState = FRAME_LEN_LO;
+  frameCrc = 0xFFFF;
+  frameIdx = 0;
+  frameSeq = 0;
+  frameError = ERR_NONE;
+  frameStart = millis();
+}
+
+/* Consume whatever is waiting on Serial without blocking.
+   Returns true once the frame is complete (frameError says whether it is valid)
+   or a ZERO_RUN cut it short */
+bool frame_poll() {
+  while (Serial.available() > 0 && frameState != FRAME_DONE) {
+    uint8_t in = Serial.read();
+    int kept = zero_run_unstuff(&in, 1);
+    if (zeroRunSeen) {
+      return true;
+    }
+    if (kept == 0) {
+      continue;
+    }
+    if (frameState < FRAME_CRC_LO) {
+      frameCrc = crc16_update(frameCrc, in);
+    }
+    switch (frameState) {
+      case FRAME_LEN_LO:
+        frameLength = in;
+        frameState = FRAME_LEN_HI;
+        break;
+      case FRAME_LEN_HI:
+        frameLength |= (uint16_t)in << 8;
+        frameState = FRAME_SEQ;
+        break;
+      case FRAME_SEQ:
+        frameSeq = in;
+        frameState = FRAME_CMD;
+        break;
+      case FRAME_CMD:
+        frameCmd = in;
+        // oversized frames are still consumed so their payload is not
+        // mistaken for ASCII commands
+        if (frameLength > FRAME_MAX_PAYLOAD) {
+          frameError = ERR_LENGTH;
+        }
+        frameState = (frameLength == 0) ? FRAME_CRC_LO : FRAME_PAYLOAD;
+        break;
+      case FRAME_PAYLOAD:
+        if (frameIdx < FRAME_MAX_PAYLOAD) {
+          frameBuffer[frameIdx] = in;
+        }
+        frameIdx++;
+        // the rest of the payload in one block read instead of a byte per pass
+        if (frameLength <= FRAME_MAX_PAYLOAD && frameIdx < frameLength) {
+          int n = min(Serial.available(), frameLength - frameIdx);
+          if (n > 0) {
+            n = Serial.readBytes((char *)frameBuffer + frameIdx, n);
+            n = zero_run_unstuff(frameBuffer + frameIdx, n);
+            if (zeroRunSeen) {
+              return true;
+            }
+            frameCrc = crc16(frameBuffer + frameIdx, n, frameCrc);
+            frameIdx += n;
+          }
+        }
+        if (frameIdx == frameLength) {
+          frameState = FRAME_CRC_LO;
+        }
+        break;
+      case FRAME_CRC_LO:
+        frameCrcRx = in;
+        frameState = FRAME_CRC_HI;
+        break;
+      case FRAME_CRC_HI:
+        frameCrcRx |= (uint16_t)in << 8;
+        if (frameCrcRx != frameCrc && frameError == ERR_NONE) {
+          frameError = ERR_CRC;
+        }
+        if (frameError == ERR_NONE) {
+          frameHostSeen = true;
+        }
+        frameState = FRAME_DONE;
+        break;
+      case FRAME_DONE:
+        break;
+    }
+  }
+  if (frameState != FRAME_DONE && millis() - frameStart > FRAME_TIMEOUT_MS) {
+    frameError = ERR_TIMEOUT;
+    frameState = FRAME_DONE;
+  }
+  return frameState == FRAME_DONE;
+}
+
+float frame_get_float(const uint8_t * p) {
+  float f;
+  memcpy(&f, p, 4);
+  return f;
+}
@@ -0,0 +1,73 @@
+/******************************************************/
+/*********************** SPSC RING ********************/
+/******************************************************/
+
+/* Lock-free ring between one producer and one consumer, typically an
+   interrupt and loop(). Each side only ever writes its own index, so neither
+   has to disable interrupts; the producer's index is published after the
+   record is copied in, the consumer's after it is copied out. On a single
+   core Cortex-M4 the compiler barrier is all the ordering that takes.
+   N is a power of two, one slot stays free to tell full from empty. */
+
+#define ring_barrier() __asm__ volatile("" ::: "memory")
+
+template <typename T, uint16_t N>
+class spsc_ring {
+  static_assert((N & (N - 1)) == 0, "spsc_ring size must be a power of two");
+
+public:
+  // producer side; a full ring drops the record and counts it
+  bool push(const T & item) {
+    uint16_t h = head;
+    uint16_t next = (h + 1) & (N - 1);
+    if (next == tail) {
+      dropped++;
+      return false;
+    }
+    buf[h] = item;
+    ring_barrier();
+    head = next;
+    return true;
+  }
+
+  // consumer side
+  bool pop(T & item) {
+    uint16_t t = tail;
+    if (t == head) {
+      return false;
+    }
+    item = buf[t];
+    ring_barrier();
+    tail = (t + 1) & (N - 1);
+    return true;
+  }
+
+  // consumer side, up to max records in one go
+  uint16_t pop(T * out, uint16_t max) {
+    uint16_t n = 0;
+    while (n < max && pop(out[n])) {
+      n++;
+    }
+    return n;
+  }
+
+  // consumer side: drop whatever is queued
+  void clear() {
+    tail = head;
+  }
+
+  bool empty() const {
+    return head == tail;
+  }
+
+  uint16_t size() const {
+    return (head - tail) & (N - 1);
+  }
+
+  volatile uint32_t dropped = 0;
+
+private:
+  T buf[N];
+  volatile uint16_t head = 0;
+  volatile uint16_t tail = 0;
+};
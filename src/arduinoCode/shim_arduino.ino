@@ -1,7 +1,9 @@
 // Feb. 2020:" This version of code uses new fiber optic board with different output channels connected to the four amplifier boards.  BoardMap variable has been updated.
 
 #include "hardware.h"
+#include "protocol.h"
 #include "util.h"
+#include "bench.h"
 #include "t3spi.h"
 
 //calibration data
@@ -11,100 +13,607 @@ bool should_next = false;
 volatile int counter = 0;
 volatile int cint = 0;
 
-volatile long tHigh = 0;
-volatile long tIrupt = 0;
-volatile bool outHigh = false;
 volatile int t;
 
 
 const int ctrlBuffer_length = 100;
 char ctrlBuffer[ctrlBuffer_length];
 
-int8_t channels_used[NUM_B][NUM_C]  =
-{
-  {0, 1, 2, 3, 4, 5, 6, 7}
-//  {0, 1, 2, 3, 4, 5, 6, 7},
-//  {0, 1, 2, 3, 4, 5, 6, 7},
-//  {0, 1, 2, 3, 4, 5, 6, 7}
-};
+// Teensy's Serial is native USB: the rate is nominal and transfers run at
+// full speed USB bulk throughput. Reported to the host with CMD_LINK_INFO
+#define LINK_BAUD 115200
+#if defined(USB_SERIAL) || defined(USB_DUAL_SERIAL) || defined(USB_TRIPLE_SERIAL)
+#define LINK_USB 1
+#else
+#define LINK_USB 0
+#endif
 
 /******************************************************/
 /*********************** IRUPT ************************/
 /******************************************************/
-long timey;
 bool first = 0;
+
+/* One record per row played, pushed by setDACVal and drained by loop() in
+   batches, so the trigger path never touches Serial or disables interrupts */
+#define TRIGGER_LOG_CODES 8
+#define TRIGGER_LOG_BATCH 16 // records per EVT_TRIGGER_LOG frame
+
+typedef struct trigger_record {
+  uint32_t cycles;   // DWT_CYCCNT right after the latch
+  int32_t counter;
+  uint16_t blk;
+  uint16_t rep;
+  uint16_t codes[TRIGGER_LOG_CODES]; // first table columns as written, before regulation trims
+} trigger_record;
+
+spsc_ring<trigger_record, 64> triggerLog;
+bool triggerArmed = false;
+
 void setDACVal() {
-  int repIdx;
-  int blkIdx = computeBlockIdx(counter);
-  if (blkIdx == -1) {
-    blkIdx = 0; repIdx = 0;
+  uint32_t t0 = stat_begin();
+  if (swapPending) {
+    table_swap();
     counter = 0;
-  } else {
-    repIdx = computeRepIdx(counter, blkIdx);
-  }
-  Serial.print("counter: ");
-  Serial.println(counter);
-  Serial.print("blkIdx: ");
-  Serial.println(blkIdx);
-  Serial.print("repIdx: ");
-  Serial.println(repIdx);
-  update_outputs(blkIdx, repIdx);
+  }
+  const uint16_t * row = table_row(cursor.row);
+  wave_stop();
+  update_outputs_row(row);
+  bnc_pulse(); // optional sync output, timed from the latch, see BNC SYNC in hardware.h
+  wave_row(cursor.blk, row); // sub-TR ramp of the row, see WAVEFORM in util.h
+  trigger_record rec;
+  rec.cycles = ARM_DWT_CYCCNT;
+  rec.counter = counter;
+  rec.blk = cursor.blk;
+  rec.rep = cursor.rep;
+  for (int i = 0; i < TRIGGER_LOG_CODES; i++) {
+    rec.codes[i] = (row != NULL && i < channels) ? row[i] : 0;
+  }
+  triggerLog.push(rec);
+  counter++;
+  if (cursor_advance()) {
+    counter = 0;
+  }
+  stat_end(STAT_SET_DAC_VAL, t0);
+  //  if (counter <= 0) {
+  //    counter = 39;
+  //  }
+}
+
+// move to the next row without writing it, for rows whose trigger was missed
+void skipDACVal() {
   counter++;
-  // optional BNC output July 2019
-     if(bncOut){
-        long tnow = millis();
-        if(tnow > tIrupt && !outHigh){
-          tHigh = tnow;
-          digitalWrite(bncPin,HIGH);
-    ////      Serial.println("High");
-          outHigh = true;
-          tIrupt = tnow;
+  if (cursor_advance()) {
+    counter = 0;
+  }
+}
 
-        }
+/******************************************************/
+/*********************** TRIGGER **********************/
+/******************************************************/
 
-       tnow = millis();
-        if(tnow > tIrupt + .013  && outHigh){
-          digitalWrite(bncPin,LOW);
-    ////      Serial.println("High");
-          outHigh = false;
-          tIrupt = tnow;
+/* The pin interrupt is only the top half: it timestamps and counts the edge
+   and pends the software interrupt, whose handler (the bottom half, at a
+   lower priority) plays one row per edge. An edge that arrives while rows
+   are still being written is never lost: the bottom half sees edgeCount run
+   ahead of stepCount and either plays the queued rows back to back or skips
+   straight to the row the sequence is on, and reports the desync. */
+
+typedef enum trigger_policy {TRIGGER_QUEUE = 0, TRIGGER_SKIP = 1} trigger_policy;
+
+trigger_policy triggerPolicy = TRIGGER_QUEUE;
+uint8_t triggerMaxQueue = 4; // more late rows than this are skipped whatever the policy
+const uint8_t triggerStepPriority = 160; // below the pin interrupt, above backgroundTimer
+
+volatile uint32_t edgeCount = 0;  // edges since the trigger was armed
+volatile uint32_t stepCount = 0;  // edges handled, played or skipped
+volatile uint32_t lastEdgeCycles = 0;
+
+// pushed by the bottom half, sent as EVT_DESYNC from loop()
+typedef struct desync_record {
+  uint32_t edge;
+  uint16_t late;     // rows that were behind
+  uint8_t action;    // trigger_policy applied
+  uint32_t events;   // desyncs so far
+} desync_record;
+
+spsc_ring<desync_record, 8> desyncLog;
+volatile uint32_t desyncEvents = 0;
+
+void trigger_edge() {
+  lastEdgeCycles = ARM_DWT_CYCCNT;
+  edgeCount++;
+  statTriggers++;
+  NVIC_SET_PENDING(IRQ_SOFTWARE);
+}
+
+void desync_note(uint32_t late, uint8_t action) {
+  statOverruns += late;
+  desyncEvents++;
+  desync_record rec;
+  rec.edge = edgeCount;
+  rec.late = (late > 0xFFFF) ? 0xFFFF : late;
+  rec.action = action;
+  rec.events = desyncEvents;
+  desyncLog.push(rec);
+}
 
+/* Teensy's handler for IRQ_SOFTWARE. A run plays at most triggerMaxQueue + 1
+   rows: with rows longer than the TR the edges would otherwise never stop
+   coming in while it runs, and loop() below it would never get the CPU. Past
+   that the rows of the edges seen so far are skipped and the pending
+   interrupt dropped, so the main loop has until the next edge */
+void software_isr(void) {
+  for (int played = 0; stepCount != edgeCount && !dacHold; played++) {
+    if (played > triggerMaxQueue) {
+      cli();
+      uint32_t behind = edgeCount - stepCount;
+      for (uint32_t i = 0; i < behind; i++) {
+        skipDACVal();
+      }
+      stepCount += behind;
+      NVIC_CLEAR_PENDING(IRQ_SOFTWARE);
+      sei();
+      desync_note(behind, TRIGGER_SKIP);
+      return;
+    }
+    uint32_t late = edgeCount - stepCount - 1;
+    if (late > 0) {
+      bool skip = (triggerPolicy == TRIGGER_SKIP || late > triggerMaxQueue);
+      desync_note(late, skip ? TRIGGER_SKIP : TRIGGER_QUEUE);
+      if (skip) {
+        for (uint32_t i = 0; i < late; i++) {
+          skipDACVal();
         }
+        stepCount += late;
+      }
+    }
+    setDACVal();
+    stepCount++;
+  }
+}
+
+void trigger_arm() {
+  if (triggerArmed) {
+    return;
+  }
+  cli();
+  edgeCount = 0;
+  stepCount = 0;
+  sei();
+  triggerLog.clear();
+  desyncLog.clear();
+  NVIC_SET_PRIORITY(IRQ_SOFTWARE, triggerStepPriority);
+  NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
+  attachInterrupt(interruptPin, trigger_edge, FALLING);
+  triggerArmed = true;
+}
+
+void trigger_halt() {
+  detachInterrupt(interruptPin);
+  wave_stop();
+  triggerArmed = false;
+}
+
+typedef enum read_mode {MODE_ACCEPT, MODE_HEADER, MODE_BODY, MODE_FRAME, MODE_BULK, MODE_DRAIN} read_mode;
+read_mode mode;
+
+/******************************************************/
+/*********************** EMERGENCY ZERO ***************/
+/******************************************************/
+
+/* Every coil to zero in microseconds. Sources are ZERO_BYTE between
+   commands, a run of them inside a frame or an upload (ZERO_RUN in
+   protocol.h), and a falling edge on emergencyPin once CMD_SET_EMERGENCY
+   has enabled it. The pin interrupt outranks everything, so it also cuts
+   into a blocking upload, a calibration or an ADC wait. The trigger is
+   detached and any DMA row write in flight is dropped. Then every board gets
+   its precomputed zero codes staged and latched together. dacHold keeps the
+   outputs at zero until the host's next command. loop() reports the zero and
+   stops regulation from there. */
+
+typedef enum zero_source {ZERO_SERIAL = 0, ZERO_PIN = 1} zero_source;
+
+// a switch to ground on emergencyPin (pulled up inside), kept in EEPROM past
+// the calibration record; erased EEPROM reads 0xFF, which leaves it off
+#define EMERGENCY_ADDRESS (CAL_ADDRESS + sizeof(cal_record))
+#define EMERGENCY_ON 0x5A
+bool emergencyIn = false;
+// pin 3 is PTA12; no other pin on port A has an interrupt attached, so the
+// port's priority is this pin's alone
+const int emergencyPin = 3;
+#define EMERGENCY_IRQ IRQ_PORTA
+const uint8_t emergencyPriority = 0; // above the trigger pin, DMA and every timer
+
+volatile uint32_t zeroCount = 0;
+volatile uint8_t zeroSource = ZERO_SERIAL;
+uint32_t zeroReported = 0;
+
+// from the main loop or the emergency pin interrupt
+void emergency_zero(uint8_t source) {
+  cli();
+  detachInterrupt(interruptPin);
+  wave_stop();
+  dac_dma_abort();
+  dacHold = true; // a row write this preempted drops the rest of its frames
+  dac_zero_boards();
+  zeroSource = source;
+  zeroCount++;
+  sei();
+}
+
+void emergency_pin() {
+  emergency_zero(ZERO_PIN);
+}
+
+void emergency_attach() {
+  if (!emergencyIn) {
+    detachInterrupt(emergencyPin);
+    return;
+  }
+  pinMode(emergencyPin, INPUT_PULLUP);
+  attachInterrupt(emergencyPin, emergency_pin, FALLING);
+  NVIC_SET_PRIORITY(EMERGENCY_IRQ, emergencyPriority);
+}
+
+void emergency_init() {
+  emergencyIn = (EEPROM.read(EMERGENCY_ADDRESS) == EMERGENCY_ON);
+  if (emergencyIn) {
+    emergency_attach();
+  }
+}
+
+// [enable]
+frame_error emergency_set(const uint8_t * payload, uint16_t len) {
+  if (len != 1) {
+    return ERR_LENGTH;
+  }
+  if (payload[0] > 1) {
+    return ERR_BAD_ARG;
+  }
+  emergencyIn = payload[0];
+  EEPROM.update(EMERGENCY_ADDRESS, emergencyIn ? EMERGENCY_ON : 0);
+  emergency_attach();
+  return ERR_NONE;
+}
+
+unsigned long drainLast;
+
+/* Throw away what the host still sends of a stream that was given up (cut
+   short by a ZERO_RUN, or stalled past BULK_TIMEOUT_MS) until the line has
+   been quiet for BULK_TIMEOUT_MS, so none of the table is read as commands */
+void drain_begin() {
+  drainLast = millis();
+  mode = MODE_DRAIN;
+}
+
+// after a ZERO_RUN the frame or upload it cut into is dropped
+bool emergency_run_check() {
+  if (!zeroRunSeen) {
+    return false;
+  }
+  zeroRunSeen = false;
+  emergency_zero(ZERO_SERIAL);
+  uploadActive = false;
+  drain_begin();
+  return true;
+}
 
+bool drain_poll() {
+  int avail;
+  while ((avail = Serial.available()) > 0) {
+    Serial.readBytes((char *)bulkBlock, min(avail, BULK_BLOCK));
+    drainLast = millis();
+  }
+  return millis() - drainLast > BULK_TIMEOUT_MS;
+}
+
+// the parts of a zero that cannot run from an interrupt
+void emergency_report() {
+  uint32_t count = zeroCount;
+  if (count == zeroReported) {
+    return;
+  }
+  zeroReported = count;
+  trigger_halt();
+  regulation_run(false);
+  if (frameHostSeen) {
+    uint8_t payload[5];
+    payload[0] = zeroSource;
+    memcpy(payload + 1, &count, 4);
+    frame_event(EVT_ZERO, payload, sizeof(payload));
+  } else {
+    Serial.println((zeroSource == ZERO_PIN) ? "Emergency Zero (pin)" : "Emergency Zero");
+    Serial.println("Done Zeroing");
+  }
+}
+
+/******************************************************/
+/*********************** FRAMES ***********************/
+/******************************************************/
 
+frame_error set_currents_frame(const uint8_t * payload, uint16_t len) {
+  if (len < 1) {
+    return ERR_LENGTH;
+  }
+  uint8_t n = payload[0];
+  if (len != 1 + 6 * n) {
+    return ERR_LENGTH;
+  }
+  const uint8_t * entry = payload + 1;
+  for (int i = 0; i < n; i++, entry += 6) {
+    if (entry[0] >= numBoards || entry[1] >= NUM_C) {
+      return ERR_BAD_ARG;
+    }
+  }
+  wave_stop();
+  // stage every channel of a board, then latch them together
+  for (int b = 0; b < numBoards; b++) {
+    bool staged = false;
+    entry = payload + 1;
+    for (int i = 0; i < n; i++, entry += 6) {
+      if (entry[0] != b) {
+        continue;
+      }
+      if (!staged) {
+        selectBoard(b);
+        staged = true;
+      }
+      uint8_t c = entry[1];
+      LTC2656Stage(channelMap[c], computeDacVal_I(frame_get_float(entry + 2), b, c));
+    }
+    if (staged) {
+      LTC2656Latch();
+    }
+  }
+  return ERR_NONE;
+}
 
+/* [n boards] then per board [select address][n channels][channel x n].
+   The table columns change meaning so the loaded tables are dropped and
+   the host uploads again; boards that moved lose their calibration */
+frame_error set_topology(const uint8_t * payload, uint16_t len) {
+  if (triggerArmed) {
+    return ERR_SEQUENCE;
+  }
+  if (len < 1 || payload[0] == 0 || payload[0] > MAX_B) {
+    return ERR_BAD_ARG;
+  }
+  int nb = payload[0];
+  uint16_t idx = 1;
+  for (int b = 0; b < nb; b++) {
+    if (idx + 2 > len) {
+      return ERR_LENGTH;
+    }
+    uint8_t addr = payload[idx];
+    uint8_t n = payload[idx + 1];
+    if (addr >= MAX_B || n == 0 || n > NUM_C || idx + 2 + n > len) {
+      return (idx + 2 + n > len) ? ERR_LENGTH : ERR_BAD_ARG;
+    }
+    uint8_t seen = 0;
+    for (int k = 0; k < n; k++) {
+      uint8_t c = payload[idx + 2 + k];
+      if (c >= NUM_C || (seen & (1 << c))) {
+        return ERR_BAD_ARG;
       }
-      long timeytmp = millis();
-    ////  Serial.println(timeytmp-timey);
-      timey = timeytmp;
-  // end bnc optional segment
+      seen |= 1 << c;
+    }
+    idx += 2 + n;
+  }
+  if (idx != len) {
+    return ERR_LENGTH;
+  }
 
-  //  if (counter <= 0) {
-  //    counter = 39;
-  //  }
+  idx = 1;
+  for (int b = 0; b < MAX_B; b++) {
+    uint8_t addr = (b < nb) ? payload[idx] : 0xFF;
+    if (b < nb) {
+      uint8_t n = payload[idx + 1];
+      for (int c = 0; c < NUM_C; c++) {
+        channels_used[b][c] = (c < n) ? payload[idx + 2 + c] : -1;
+      }
+      idx += 2 + n;
+    }
+    if (b >= numBoards || addr != boardMap[b]) {
+      for (int c = 0; c < NUM_C; c++) {
+        zeroPoint[b][c] = 0;
+        gain[b][c] = -1.6;
+        calibrationStatus[b][c] = false;
+      }
+    }
+    if (b < nb) {
+      boardMap[b] = addr;
+    }
+  }
+  bool monitoring = telemetryActive; // rounds are laid out by the write plan
+  telemetry_run(false);
+  numBoards = nb;
+  build_topology();
+  calibration_save();
+  zero_codes_update();
+  calibrationEpoch++;
+
+  uploadActive = false;
+  stagedReady = false;
+  swapPending = false;
+  dacStoreLength = 0;
+  dacStore = codePool;
+  tableIndex = NULL;
+  channels = numColumns;
+  cursor_reset();
+  telemetry_run(monitoring);
+  return ERR_NONE;
 }
 
-//}
+/* While triggered the swap waits for the next edge so a row is never played
+   from a half switched table; otherwise it happens right away */
+frame_error table_commit() {
+  if (!stagedReady) {
+    return ERR_SEQUENCE;
+  }
+  if (triggerArmed) {
+    swapPending = true;
+  } else {
+    cli();
+    table_swap();
+    counter = 0;
+    sei();
+  }
+  return ERR_NONE;
+}
 
-typedef enum read_mode {MODE_ACCEPT, MODE_HEADER, MODE_BODY} read_mode;
-read_mode mode;
+uint8_t replyBuffer[FRAME_MAX_PAYLOAD];
+
+void handle_frame() {
+  frame_error err = frameError;
+  int replyLength = -1; // >= 0: answer with a FRAME_REPLY instead of the ACK
+  if (err == ERR_NONE) {
+    switch (frameCmd) {
+      case CMD_PING:
+        break;
+      case CMD_SET_CURRENTS:
+        err = set_currents_frame(frameBuffer, frameLength);
+        break;
+      case CMD_ZERO:
+        wave_stop();
+        zero_all();
+        break;
+      case CMD_SET_SPI_CLOCK:
+        if (frameLength != 2) {
+          err = ERR_LENGTH;
+        } else if (!spiSetClocks(frameBuffer[0], frameBuffer[1])) {
+          err = ERR_BAD_ARG;
+        }
+        break;
+      case CMD_UPLOAD_BEGIN:
+        err = upload_begin(frameBuffer, frameLength);
+        break;
+      case CMD_UPLOAD_CHUNK:
+        err = upload_chunk(frameBuffer, frameLength);
+        break;
+      case CMD_UPLOAD_END:
+        err = upload_end();
+        if (err == ERR_NONE && !(frameLength >= 1 && frameBuffer[0] == 1)) {
+          err = table_commit();
+        }
+        break;
+      case CMD_TABLE_COMMIT:
+        err = table_commit();
+        break;
+      case CMD_SET_TOPOLOGY:
+        err = set_topology(frameBuffer, frameLength);
+        break;
+      case CMD_SET_REGULATION:
+        err = regulation_set(frameBuffer, frameLength, triggerArmed);
+        break;
+      case CMD_SET_BNC:
+        if (frameLength != 4) {
+          err = ERR_LENGTH;
+        } else {
+          uint16_t delayUs;
+          uint16_t widthUs;
+          memcpy(&delayUs, frameBuffer, 2);
+          memcpy(&widthUs, frameBuffer + 2, 2);
+          if (!bncSetTiming(delayUs, widthUs)) {
+            err = ERR_BAD_ARG;
+          }
+        }
+        break;
+      case CMD_SET_TRIGGER:
+        if (frameLength != 2) {
+          err = ERR_LENGTH;
+        } else if (frameBuffer[0] > TRIGGER_SKIP) {
+          err = ERR_BAD_ARG;
+        } else {
+          triggerPolicy = (trigger_policy)frameBuffer[0];
+          triggerMaxQueue = frameBuffer[1];
+        }
+        break;
+      case CMD_UPLOAD_BULK:
+        err = upload_bulk_begin(frameBuffer, frameLength);
+        if (err == ERR_NONE) {
+          mode = MODE_BULK; // the raw stream follows the ACK
+        }
+        break;
+      case CMD_LINK_INFO: {
+        if (frameLength != 0) {
+          err = ERR_LENGTH;
+          break;
+        }
+        uint32_t baud = LINK_BAUD;
+        uint16_t maxPayload = FRAME_MAX_PAYLOAD;
+        uint16_t block = BULK_BLOCK;
+        replyBuffer[0] = LINK_USB;
+        memcpy(replyBuffer + 1, &baud, 4);
+        memcpy(replyBuffer + 5, &maxPayload, 2);
+        memcpy(replyBuffer + 7, &block, 2);
+        replyLength = 9;
+        break;
+      }
+      case CMD_SET_RAMP:
+        err = wave_set_ramp(frameBuffer, frameLength, triggerArmed);
+        break;
+      case CMD_SET_WAVEFORM:
+        err = wave_set_map(frameBuffer, frameLength, triggerArmed);
+        break;
+      case CMD_SET_TELEMETRY:
+        err = telemetry_set(frameBuffer, frameLength);
+        break;
+      case CMD_SET_EMERGENCY:
+        err = emergency_set(frameBuffer, frameLength);
+        break;
+      case CMD_GET_CALIBRATION:
+        if (frameLength != 1) {
+          err = ERR_LENGTH;
+        } else {
+          replyLength = calibration_pack(replyBuffer, frameBuffer[0]);
+        }
+        break;
+      case CMD_GET_STATS:
+        if (frameLength > 1) {
+          err = ERR_LENGTH;
+          break;
+        }
+        replyLength = stats_pack(replyBuffer, SPI_MASTER->wordCT, SPI_SLAVE->wordCT, adcTimeouts);
+        if (frameLength == 1 && frameBuffer[0] == 1) {
+          stats_reset();
+        }
+        break;
+      case CMD_SET_ADC_FILTER:
+        if (frameLength != 2) {
+          err = ERR_LENGTH;
+        } else if (!adcSetFilter(frameBuffer[0], frameBuffer[1])) {
+          err = ERR_BAD_ARG;
+        }
+        break;
+      default:
+        err = ERR_UNKNOWN_CMD;
+        break;
+    }
+  }
+  if (err == ERR_NONE && replyLength >= 0) {
+    frame_reply(frameSeq, frameCmd, replyBuffer, replyLength);
+  } else if (err == ERR_NONE) {
+    frame_ack(frameSeq);
+  } else {
+    frame_nak(frameSeq, err);
+  }
+}
 /******************************************************/
 /*********************** SETUP ************************/
 /******************************************************/
 
 void setup() {
   mode = MODE_ACCEPT;
-  read_in_flight = false;
-  Serial.begin(115200);
+  Serial.begin(LINK_BAUD); // ignored by native USB, which always runs at full speed
 
   //SETUP board and function select
   initIO();
   selectNone();
   spiInit();
+  stats_init();
 
   //Initialize calibration data
-  for (int b = 0; b < NUM_B; b++) {
-    selectBoard(b);
+  for (int b = 0; b < MAX_B; b++) {
     for (int c = 0; c < NUM_C; c++) {
       zeroPoint[b][c] = 0;
       gain[b][c] = -1.6;
@@ -112,26 +621,15 @@ void setup() {
     }
   }
 
-
-  for (int j = 0; j < NUM_B * NUM_C; j++) {
-    channel_order[j] = -1;
-    board_order[j] = -1;
-  }
-  int i = 0;
-  for (int b = 0; b < NUM_B; b++) {
-    for (int c = 0; c < NUM_C; c++) {
-      if (channels_used[b][c] != -1) {
-        channel_order[i] = channels_used[b][c];
-        board_order[i] = b;
-        i = i + 1;
-      } else {
-        break;
-      }
-    }
+  build_topology();
+  if (calibration_load()) {
+    Serial.println("calibration loaded");
   }
+  zero_codes_update();
+  emergency_init();
 
   delay(500);
-   // attachInterrupt(interruptPin, setDACVal, FALLING);  // <===== Uncomment this line to enable TRIGGERING
+  // triggering is armed from the host with 'G' and disarmed with 'H'
 
   //    attachInterrupt(4, setDACVal, RISING);
   Serial.println("I'm up");
@@ -154,10 +652,65 @@ void setup() {
   //  zero_all();
   selectBoard(4);
   delay(100);
-  Serial.println(NUM_B);
+  Serial.println(numBoards);
   Serial.println(NUM_C);
   selectNone();
   compute_transitions_base();
+  load_default_table();
+  cursor_reset();
+}
+
+void send_desync_events() {
+  desync_record rec;
+  while (desyncLog.pop(rec)) {
+    uint8_t payload[11];
+    memcpy(payload, &rec.edge, 4);
+    memcpy(payload + 4, &rec.late, 2);
+    payload[6] = rec.action;
+    memcpy(payload + 7, &rec.events, 4);
+    frame_event(EVT_DESYNC, payload, sizeof(payload));
+  }
+}
+
+// [n][u32 records dropped so far] then n x [u32 cycles][i32 counter][u16 blk][u16 rep][u16 codes x TRIGGER_LOG_CODES]
+void send_trigger_log() {
+  trigger_record recs[TRIGGER_LOG_BATCH];
+  uint16_t n = triggerLog.pop(recs, TRIGGER_LOG_BATCH);
+  if (n == 0) {
+    return;
+  }
+  uint32_t dropped = triggerLog.dropped;
+  replyBuffer[0] = n;
+  memcpy(replyBuffer + 1, &dropped, 4);
+  uint8_t * p = replyBuffer + 5;
+  for (int i = 0; i < n; i++) {
+    memcpy(p, &recs[i].cycles, 4);
+    memcpy(p + 4, &recs[i].counter, 4);
+    memcpy(p + 8, &recs[i].blk, 2);
+    memcpy(p + 10, &recs[i].rep, 2);
+    memcpy(p + 12, recs[i].codes, 2 * TRIGGER_LOG_CODES);
+    p += 12 + 2 * TRIGGER_LOG_CODES;
+  }
+  frame_event(EVT_TRIGGER_LOG, replyBuffer, p - replyBuffer);
+}
+
+void send_telemetry() {
+  telemetry_record rec;
+  while (telemetryRing.pop(rec)) {
+    frame_event(EVT_TELEMETRY, replyBuffer, telemetry_pack(replyBuffer, &rec));
+  }
+}
+
+void print_trigger_log() {
+  trigger_record rec;
+  while (triggerLog.pop(rec)) {
+    Serial.print("counter: ");
+    Serial.println(rec.counter);
+    Serial.print("blkIdx: ");
+    Serial.println(rec.blk);
+    Serial.print("repIdx: ");
+    Serial.println(rec.rep);
+  }
 }
 
 
@@ -168,14 +721,19 @@ void setup() {
 
 
 void loop() {
-  //  if(bncOut & outHigh){
-  //    long tnow = millis();
-  //    if(tnow > tHigh + 100){
-  //       digitalWrite(bncPin,LOW);
-  //       outHigh = false;
-  //       Serial.println("low");
-  //    }
-  //  }
+  if (mode == MODE_ACCEPT || mode == MODE_DRAIN) {
+    emergency_report();
+  }
+  // only once the host has shown it speaks frames, an ascii host would choke on them
+  if (frameHostSeen) {
+    if (mode == MODE_ACCEPT) {
+      send_trigger_log();
+      send_desync_events();
+      send_telemetry();
+    }
+  } else {
+    print_trigger_log();
+  }
   if (should_next) {
     //    zero_all();
     //    calibrate_all();
@@ -190,33 +748,75 @@ void loop() {
       char channelStr[3];
       char floatStr[20]; // Assuming the maximum length of the float string is 20 characters
       char buffer[64]; // Assuming the maximum length of the input line is 64 characters
-      char ch;
       int in;
       if (Serial.available() > 0) {
         incomingByte = Serial.read();
+        if ((uint8_t)incomingByte == ZERO_BYTE) {
+          emergency_zero(ZERO_SERIAL);
+          // the rest of the ZERO_RUN, sent in case this was inside an upload
+          while (Serial.peek() == ZERO_BYTE) {
+            Serial.read();
+          }
+          break;
+        }
+        dacHold = false; // the host is back in control after a zero
+        if ((uint8_t)incomingByte == FRAME_SYNC) { // binary frame, never echoed
+          frame_begin();
+          mode = MODE_FRAME;
+          break;
+        }
         Serial.print(incomingByte);
         switch (incomingByte) {
           case 1:
             counter = 0;
+            cursor_reset();
             mode = MODE_HEADER;
           case 'Z':  // zero all the currents immediately
+            wave_stop();
             zero_all();
             Serial.println("\nDone Zeroing");
             break;
           case 'C':
-            for (int i = 0; i < NUM_C; i++) {
-              Serial.println("calibrating a channel");
-              calibrate_channel(0, i);
-              Serial.println("calibrated a channel");
-            }
+            Serial.print("calibrated ");
+            Serial.print(calibrate_all());
+            Serial.print(" of ");
+            Serial.println(numBoards * NUM_C);
+            calibration_save();
+            recode_dac_table();
             Serial.println("Done Calibrating");
             break;
           case 'D':
             for (int i = 0; i < 1; i++) {
               calibrate_channel(0, i);
             }
+            calibration_save();
+            recode_dac_table();
+            break;
+          case 'K':  // warm start: recalibrate only the channels that drifted
+            Serial.print("recalibrated ");
+            Serial.println(calibration_drift_check());
+            recode_dac_table();
+            Serial.println("Done Calibrating");
+            break;
+          case 'G':  // arm the scanner trigger
+            trigger_arm();
+            regulation_run(true);
+            Serial.println("Trigger Armed");
+            break;
+          case 'H':  // disarm the scanner trigger
+            trigger_halt();
+            regulation_run(false);
+            if (swapPending) {
+              table_commit();
+            }
+            Serial.println("Trigger Halted");
             break;
           case 'T':
+            // the trigger's bottom half owns the row cursor while armed
+            if (triggerArmed) {
+              Serial.println("trigger armed, send H first");
+              break;
+            }
             setDACVal(); // advance to next row of shim currents
             break;
           case 'I':   // display current on each channel from ADC.  Only reads over the range -1.2A to 1.2A
@@ -226,26 +826,32 @@ void loop() {
           case 'A':
             print_all_boards();
             break;
+          case 'B':  // time the hot paths, see bench.h
+            bench_run(triggerArmed);
+            break;
           case 'S':
             selectBoard(0);
             LTC2656Write(WRITE_AND_UPDATE, channelMap[0], computeDacVal_I(0.5, 0, 0));
             break;
           case 'M':  // load first row of shims
+            if (triggerArmed) {
+              Serial.println("trigger armed, send H first");
+              break;
+            }
             counter = 0;
             cint = 0;
             should_next = false;
             Serial.println(counter);
-            update_outputs(0, 0);
+            cursor_reset();
+            update_outputs_row(table_row(cursor.row), STAT_UPDATE_MAIN);
+            cursor_advance();
             counter += 1;
           case 'X': // Initiate instruction reading
 
             Serial.read();
             // Read the sequence until newline or buffer limit
             in = 0;
-            while (Serial.available() > 0) {
-              ch = Serial.read(); // Read a character from serial input
-              buffer[in++] = ch; // Store the character in the buffer
-            }
+            in = Serial.readBytes(buffer, min(Serial.available(), (int)sizeof(buffer) - 1));
             buffer[in] = '\0'; // Null-terminate the buffer
 
             // Parse the sequence
@@ -273,6 +879,11 @@ void loop() {
       if (Serial.available()) {
         int ctrlBuff_readlen =
           Serial.readBytesUntil(0, ctrlBuffer, ctrlBuffer_length);
+        // the header is ascii, any ZERO_BYTE in it is the host's
+        zeroRunSeen = memchr(ctrlBuffer, ZERO_BYTE, ctrlBuff_readlen) != NULL;
+        if (emergency_run_check()) {
+          break;
+        }
         read_ctrl_string(ctrlBuffer);
         mode = MODE_BODY;
       }
@@ -280,6 +891,28 @@ void loop() {
     case MODE_BODY:
       if (read_float_dump()) {
         mode = MODE_ACCEPT;
+        emergency_run_check();
+      }
+      break;
+    case MODE_FRAME:
+      if (frame_poll()) {
+        mode = MODE_ACCEPT;
+        if (!emergency_run_check()) {
+          handle_frame(); // may move on to MODE_BULK
+        }
+      }
+      break;
+    case MODE_BULK:
+      if (upload_bulk_poll()) {
+        mode = MODE_ACCEPT;
+        if (!emergency_run_check() && bulkError == ERR_TIMEOUT) {
+          drain_begin(); // the rest of the stream may still be on its way
+        }
+      }
+      break;
+    case MODE_DRAIN:
+      if (drain_poll()) {
+        mode = MODE_ACCEPT;
       }
       break;
   }
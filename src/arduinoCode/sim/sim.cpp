@@ -0,0 +1,589 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+#include "sim.h"
+
+/******************************************************/
+/*********************** REGISTERS ********************/
+/******************************************************/
+
+KINETISK_SPI_t KINETISK_SPI0;
+KINETISK_SPI_t KINETISK_SPI1;
+volatile uint32_t ARM_DWT_CYCCNT = 0;
+volatile uint32_t ARM_DEMCR = 0;
+volatile uint32_t ARM_DWT_CTRL = 0;
+
+// erased, like a part that never ran the sketch
+uint8_t simEeprom[SIM_EEPROM_SIZE];
+static struct eeprom_erase {
+  eeprom_erase() { memset(simEeprom, 0xFF, sizeof(simEeprom)); }
+} eepromErase;
+
+usb_serial_class Serial;
+
+sim_wiring simWiring;
+sim_board simBoards[SIM_BOARDS];
+sim_profile simTriggerProfile;
+uint64_t simSpiWords = 0;
+uint64_t simBadFrames = 0;
+uint64_t simSlaveGarbage = 0;
+float simAdcNoise = 1.0;
+bool simSerialEcho = false;
+
+/******************************************************/
+/*********************** CLOCK AND NVIC ***************/
+/******************************************************/
+
+static uint64_t nowNs = 0;
+
+typedef struct sim_source {
+  void (*fn)(void);
+  uint8_t priority;
+  bool enabled;
+  bool pending;
+} sim_source;
+
+static sim_source nvic[NVIC_NUM_INTERRUPTS];
+static std::vector<IntervalTimer *> timers;
+
+typedef struct sim_pin_irq {
+  void (*fn)(void);
+  int mode;
+  bool pending;
+} sim_pin_irq;
+
+static sim_pin_irq pinIrq[CORE_NUM_DIGITAL];
+static const uint8_t pinPriority = 128; // Teensy default for every port
+static uint8_t pins[CORE_NUM_DIGITAL];
+
+static int level = 256;   // priority of the code running now, 256 = thread mode
+static bool irqOff = false;
+
+static uint8_t trigPin;
+static uint64_t trigNextNs;
+static uint64_t trigPeriodNs;
+static uint64_t trigLeft = 0;
+static uint64_t trigLost = 0;
+
+static uint8_t edgePin;
+static uint64_t edgeNs = UINT64_MAX;
+
+static std::deque<uint16_t> slaveFifo;
+#define SLAVE_FIFO_DEPTH 4
+
+static void set_now(uint64_t t) {
+  nowNs = t;
+  ARM_DWT_CYCCNT = uint32_t(t * (F_CPU / 1000000) / 1000);
+}
+
+uint64_t sim_now_ns() {
+  return nowNs;
+}
+
+static void run_isr(void (*fn)(void), int priority) {
+  int saved = level;
+  level = priority;
+  if (fn == software_isr) {
+    uint64_t t0 = nowNs;
+    auto h0 = std::chrono::steady_clock::now();
+    fn();
+    uint64_t host = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - h0).count();
+    uint64_t sim = nowNs - t0;
+    simTriggerProfile.count++;
+    simTriggerProfile.simNs += sim;
+    simTriggerProfile.simMaxNs = max(simTriggerProfile.simMaxNs, sim);
+    simTriggerProfile.hostNs += host;
+    simTriggerProfile.hostMaxNs = max(simTriggerProfile.hostMaxNs, host);
+  } else {
+    fn();
+  }
+  level = saved;
+}
+
+// the port A pins take NVIC_SET_PRIORITY(IRQ_PORTA), the others keep the default
+static uint8_t pin_priority(int pin) {
+  bool portA = (pin == 3 || pin == 4 || pin == 24 || pin == 33);
+  return portA ? nvic[IRQ_PORTA].priority : pinPriority;
+}
+
+// run everything pending that outranks the running code, highest first
+static void dispatch() {
+  while (!irqOff) {
+    int best = level;
+    sim_source * src = NULL;
+    sim_pin_irq * pin = NULL;
+    IntervalTimer * timer = NULL;
+    for (int i = 0; i < NVIC_NUM_INTERRUPTS; i++) {
+      if (nvic[i].pending && nvic[i].enabled && nvic[i].fn && nvic[i].priority < best) {
+        best = nvic[i].priority;
+        src = &nvic[i];
+      }
+    }
+    for (int i = 0; i < CORE_NUM_DIGITAL; i++) {
+      if (pinIrq[i].pending && pin_priority(i) < best) {
+        best = pin_priority(i);
+        src = NULL;
+        pin = &pinIrq[i];
+      }
+    }
+    for (IntervalTimer * t : timers) {
+      if (t->pending && t->prio < best) {
+        best = t->prio;
+        src = NULL;
+        pin = NULL;
+        timer = t;
+      }
+    }
+    if (src) {
+      src->pending = false;
+      run_isr(src->fn, src->priority);
+      // the slave keeps RFDF raised while its FIFO holds words
+      if (src == &nvic[IRQ_SPI1] && !slaveFifo.empty()) {
+        src->pending = true;
+      }
+    } else if (pin) {
+      pin->pending = false;
+      run_isr(pin->fn, best);
+    } else if (timer) {
+      timer->pending = false;
+      run_isr(timer->callback, timer->prio);
+    } else {
+      return;
+    }
+  }
+}
+
+static uint64_t next_event() {
+  uint64_t next = UINT64_MAX;
+  for (IntervalTimer * t : timers) {
+    if (t->active) {
+      next = min(next, t->nextNs);
+    }
+  }
+  if (trigLeft > 0) {
+    next = min(next, trigNextNs);
+  }
+  return min(next, edgeNs);
+}
+
+static void fire_due() {
+  for (IntervalTimer * t : timers) {
+    if (t->active && t->nextNs <= nowNs) {
+      t->pending = true; // a PIT flag, periods missed while it is set are lost
+      while (t->nextNs <= nowNs) {
+        t->nextNs += t->periodNs;
+      }
+    }
+  }
+  while (trigLeft > 0 && trigNextNs <= nowNs) {
+    sim_pin_irq * p = &pinIrq[trigPin];
+    if (p->fn && (p->mode == FALLING || p->mode == CHANGE)) {
+      p->pending = true;
+    } else {
+      trigLost++;
+    }
+    trigNextNs += trigPeriodNs;
+    trigLeft--;
+  }
+  if (edgeNs <= nowNs) {
+    sim_pin_irq * p = &pinIrq[edgePin];
+    if (p->fn && (p->mode == FALLING || p->mode == CHANGE)) {
+      p->pending = true;
+    }
+    edgeNs = UINT64_MAX;
+  }
+}
+
+void sim_advance_ns(uint64_t ns) {
+  uint64_t target = nowNs + ns;
+  for (;;) {
+    uint64_t next = next_event();
+    if (next > target) {
+      break;
+    }
+    // interrupts that ran in between may have moved the clock past next
+    if (next > nowNs) {
+      set_now(next);
+    }
+    fire_due();
+    dispatch();
+  }
+  if (target > nowNs) {
+    set_now(target);
+  }
+}
+
+bool sim_idle() {
+  uint64_t next = next_event();
+  if (next == UINT64_MAX) {
+    return false;
+  }
+  sim_advance_ns((next > nowNs) ? next - nowNs : 0);
+  return true;
+}
+
+void sim_irq_enable(int irq, bool on) {
+  nvic[irq].enabled = on;
+  if (on) {
+    dispatch();
+  }
+}
+
+void sim_irq_pend(int irq) {
+  nvic[irq].pending = true;
+  dispatch();
+}
+
+void sim_irq_unpend(int irq) {
+  nvic[irq].pending = false;
+}
+
+void sim_irq_priority(int irq, uint8_t priority) {
+  nvic[irq].priority = priority;
+}
+
+void sim_irq_off(bool off) {
+  irqOff = off;
+  if (!off) {
+    dispatch();
+  }
+}
+
+void sim_isr(void (*fn)(void), uint8_t priority) {
+  run_isr(fn, priority);
+}
+
+void sim_trigger(uint8_t pin, uint64_t startNs, uint64_t periodNs, uint64_t count) {
+  trigPin = pin;
+  trigNextNs = startNs;
+  trigPeriodNs = max<uint64_t>(periodNs, 1);
+  trigLeft = count;
+}
+
+uint64_t sim_trigger_left() {
+  return trigLeft;
+}
+
+uint64_t sim_trigger_lost() {
+  return trigLost;
+}
+
+void sim_pin_edge(uint8_t pin, uint64_t atNs) {
+  edgePin = pin;
+  edgeNs = atNs;
+}
+
+bool IntervalTimer::start(void (*function)(), uint64_t ns) {
+  callback = function;
+  periodNs = max<uint64_t>(ns, 1000);
+  nextNs = nowNs + periodNs;
+  pending = false;
+  active = true;
+  if (std::find(timers.begin(), timers.end(), this) == timers.end()) {
+    timers.push_back(this);
+  }
+  return true;
+}
+
+void IntervalTimer::end() {
+  active = false;
+  pending = false;
+}
+
+/******************************************************/
+/*********************** PINS AND TIME ****************/
+/******************************************************/
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  pins[pin] = value ? HIGH : LOW;
+  sim_advance_ns(SIM_PIN_NS);
+}
+
+void digitalWriteFast(uint8_t pin, uint8_t value) {
+  pins[pin] = value ? HIGH : LOW;
+}
+
+uint8_t digitalRead(uint8_t pin) {
+  return pins[pin];
+}
+
+void attachInterrupt(uint8_t pin, void (*function)(void), int mode) {
+  pinIrq[pin].fn = function;
+  pinIrq[pin].mode = mode;
+  pinIrq[pin].pending = false;
+}
+
+void detachInterrupt(uint8_t pin) {
+  pinIrq[pin].fn = NULL;
+  pinIrq[pin].pending = false;
+}
+
+void delay(uint32_t ms) {
+  sim_advance_ns(ms * 1000000ULL);
+}
+
+void delayMicroseconds(uint32_t us) {
+  sim_advance_ns(us * 1000ULL);
+}
+
+uint32_t millis() {
+  sim_advance_ns(SIM_POLL_NS);
+  return uint32_t(nowNs / 1000000);
+}
+
+uint32_t micros() {
+  sim_advance_ns(SIM_POLL_NS);
+  return uint32_t(nowNs / 1000);
+}
+
+/******************************************************/
+/*********************** BOARDS ***********************/
+/******************************************************/
+
+static uint32_t rng = 1;
+
+// xorshift32, uniform in [-1, 1)
+static float noise() {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return (rng >> 8) / float(1 << 23) - 1.0f;
+}
+
+void sim_reset(uint32_t seed) {
+  rng = seed ? seed : 1;
+  for (int i = 0; i < NVIC_NUM_INTERRUPTS; i++) {
+    nvic[i].priority = 128;
+  }
+  nvic[IRQ_SOFTWARE].fn = software_isr;
+  nvic[IRQ_SPI1].fn = spi1_isr;
+  for (int a = 0; a < SIM_BOARDS; a++) {
+    sim_board * b = &simBoards[a];
+    b->present = true;
+    for (int c = 0; c < SIM_CHANNELS; c++) {
+      // mid scale, so an unwritten channel sits near zero current
+      b->input[c] = 32768;
+      b->output[c] = 32768;
+      b->gain[c] = -1.62f + 0.05f * noise();
+      b->offset[c] = 0.02f * noise();
+    }
+    b->adcNext = 0;
+    b->frames = 0;
+    b->latches = 0;
+  }
+}
+
+static int board_address() {
+  return (pins[simWiring.boardSelect[0]] ? 1 : 0)
+      | (pins[simWiring.boardSelect[1]] ? 2 : 0)
+      | (pins[simWiring.boardSelect[2]] ? 4 : 0);
+}
+
+bool sim_select_dac() {
+  return !pins[simWiring.selectPin0] && !pins[simWiring.selectPin1];
+}
+
+static bool select_adc() {
+  return pins[simWiring.selectPin0] && !pins[simWiring.selectPin1];
+}
+
+float sim_current(int address, int channel) {
+  const sim_board * b = &simBoards[address];
+  float volts = b->output[simWiring.dacAddress[channel]] * 5.0f / 65535.0f;
+  return b->gain[channel] * (volts - 2.5f + b->offset[channel]);
+}
+
+// LTC1863 code of the channel on mux input, readout of 1.25 V + 0.2 ohm * 10 per amp
+static uint16_t adc_convert(int address, uint8_t mux) {
+  for (int c = 0; c < SIM_CHANNELS; c++) {
+    if (simWiring.adcMux[c] == mux) {
+      float code = (2.0f * sim_current(address, c) + 1.25f) * 1000.0f + simAdcNoise * noise();
+      return uint16_t(constrain(code + 0.5f, 0.0f, 4095.0f));
+    }
+  }
+  return 0;
+}
+
+static void dac_command(sim_board * b, const uint16_t * words) {
+  uint8_t cmd = words[0] & 0xF0;
+  uint8_t addr = words[0] & 0x0F;
+  uint16_t value = words[1];
+  for (int k = 0; k < SIM_CHANNELS; k++) {
+    if (addr != 0x0F && addr != k) {
+      continue;
+    }
+    switch (cmd) {
+      case 0x00: // WRITE_TO_INPUT
+        b->input[k] = value;
+        break;
+      case 0x10: // UPDATE_DAC
+        b->output[k] = b->input[k];
+        break;
+      case 0x20: // WRITE_TO_INPUT_UPDATE_ALL
+        b->input[k] = value;
+        break;
+      case 0x30: // WRITE_AND_UPDATE
+        b->input[k] = value;
+        b->output[k] = value;
+        break;
+    }
+  }
+  if (cmd == 0x20) {
+    memcpy(b->output, b->input, sizeof(b->output));
+  }
+  if (cmd == 0x10 || cmd == 0x20 || cmd == 0x30) {
+    b->latches++;
+  }
+}
+
+void sim_spi_frame(const uint16_t * words, int n, int divider) {
+  int address = board_address();
+  sim_board * b = &simBoards[address];
+  bool adc = select_adc() && b->present;
+  bool listening = !pins[simWiring.slaveSelect];
+  if (sim_select_dac() && b->present) {
+    b->frames++;
+    if (n == 2) {
+      dac_command(b, words);
+    } else {
+      simBadFrames++;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    // the ADC shifts out the conversion in progress while the next command shifts in
+    uint16_t miso = 0xFFFF;
+    if (adc) {
+      miso = adc_convert(address, b->adcNext) << 4;
+      b->adcNext = (words[i] >> 12) & 0x07;
+    }
+    if (listening) {
+      if (!adc) {
+        simSlaveGarbage++;
+      }
+      if (slaveFifo.size() < SLAVE_FIFO_DEPTH) {
+        slaveFifo.push_back(miso);
+      }
+    }
+  }
+  simSpiWords += n;
+  sim_advance_ns(SIM_FRAME_NS + uint64_t(n) * 16 * divider * 1000000000ULL / F_BUS);
+  if (!slaveFifo.empty()) {
+    sim_irq_pend(IRQ_SPI1);
+  }
+}
+
+uint16_t sim_slave_pop() {
+  if (slaveFifo.empty()) {
+    return 0xFFFF;
+  }
+  uint16_t w = slaveFifo.front();
+  slaveFifo.pop_front();
+  return w;
+}
+
+/******************************************************/
+/*********************** SERIAL ***********************/
+/******************************************************/
+
+static std::deque<uint8_t> serialIn;
+static std::string serialOut;
+
+void sim_serial_feed(const void * data, size_t length) {
+  const uint8_t * p = (const uint8_t *)data;
+  serialIn.insert(serialIn.end(), p, p + length);
+}
+
+size_t sim_serial_pending() {
+  return serialIn.size();
+}
+
+std::string sim_serial_take() {
+  std::string out;
+  out.swap(serialOut);
+  return out;
+}
+
+int usb_serial_class::available() {
+  return int(min<size_t>(serialIn.size(), 0x7FFFFFFF));
+}
+
+int usb_serial_class::read() {
+  if (serialIn.empty()) {
+    return -1;
+  }
+  uint8_t b = serialIn.front();
+  serialIn.pop_front();
+  sim_advance_ns(SIM_SERIAL_BYTE_NS);
+  return b;
+}
+
+int usb_serial_class::peek() {
+  return serialIn.empty() ? -1 : serialIn.front();
+}
+
+// the host only sends between loop() passes, so running dry means waiting out the timeout
+size_t usb_serial_class::readBytes(char * buffer, size_t length) {
+  size_t n = min(length, serialIn.size());
+  for (size_t i = 0; i < n; i++) {
+    buffer[i] = serialIn.front();
+    serialIn.pop_front();
+  }
+  sim_advance_ns(n * SIM_SERIAL_BYTE_NS);
+  if (n < length) {
+    sim_advance_ns(timeoutMs * 1000000ULL);
+  }
+  return n;
+}
+
+size_t usb_serial_class::readBytesUntil(char terminator, char * buffer, size_t length) {
+  size_t n = 0;
+  while (n < length && !serialIn.empty()) {
+    char c = serialIn.front();
+    serialIn.pop_front();
+    if (c == terminator) {
+      break;
+    }
+    buffer[n++] = c;
+  }
+  sim_advance_ns(n * SIM_SERIAL_BYTE_NS);
+  return n;
+}
+
+size_t usb_serial_class::write(const uint8_t * buffer, size_t size) {
+  serialOut.append((const char *)buffer, size);
+  if (simSerialEcho) {
+    fwrite(buffer, 1, size, stdout);
+  }
+  return size;
+}
+
+size_t usb_serial_class::print(long n) {
+  char s[24];
+  return write(s, snprintf(s, sizeof(s), "%ld", n));
+}
+
+size_t usb_serial_class::print(unsigned long n) {
+  char s[24];
+  return write(s, snprintf(s, sizeof(s), "%lu", n));
+}
+
+size_t usb_serial_class::print(double n, int digits) {
+  char s[48];
+  if (isnan(n)) {
+    return print("nan");
+  }
+  if (isinf(n)) {
+    return print("inf");
+  }
+  if (n > 4294967040.0 || n < -4294967040.0) {
+    return print("ovf");
+  }
+  return write(s, snprintf(s, sizeof(s), "%.*f", digits, n));
+}
@@ -0,0 +1,100 @@
+#ifndef _sim_h
+#define _sim_h
+
+/******************************************************/
+/*********************** SIMULATOR ********************/
+/******************************************************/
+
+/* Host side model of the shim driver hardware the sketch runs on.
+
+   Time is simulated: it only moves when the sketch waits (delay, micros
+   polling, serial reads) or puts words on the SPI wire, and sim_idle() jumps
+   straight to the next timer or trigger edge. Every advance fires the
+   IntervalTimers, pin interrupts and NVIC sources that came due, at their
+   priority against the code that is running, so a trigger edge preempts the
+   row write of the one before it exactly where the wire time says it would.
+
+   Behind SPI0 sits one board per select address: an LTC2656 with input and
+   output registers, an amplifier per channel (current = gain * (Vdac - 2.5 +
+   offset)) and an LTC1863 that converts those currents back through SPI1.
+   CPU time is not modelled beyond the rough per call costs below, so
+   trigger costs are wire time plus those. Compare with a 'B' run on the
+   real board (bench.h) and adjust them when they disagree. */
+
+#include <stdint.h>
+#include <string>
+
+#define SIM_BOARDS 8     // select addresses
+#define SIM_CHANNELS 8
+
+// rough Teensy 3.2 costs at 96 MHz, in ns
+#define SIM_FRAME_NS 400         // CS setup and hold, FIFO turnaround per SPI frame
+#define SIM_PIN_NS 120           // digitalWrite
+#define SIM_POLL_NS 50           // micros()/millis(), so polling loops make progress
+#define SIM_SERIAL_BYTE_NS 1000  // USB full speed bulk, about 1 MB/s
+
+// how the boards are wired to the Teensy, filled from hardware.h by the driver
+typedef struct sim_wiring {
+  uint8_t selectPin0;
+  uint8_t selectPin1;
+  uint8_t boardSelect[3];      // address bits 0, 1, 2
+  uint8_t slaveSelect;         // CS_BB, low while SPI1 listens
+  uint8_t dacAddress[SIM_CHANNELS];  // channel -> LTC2656 output
+  uint8_t adcMux[SIM_CHANNELS];      // channel -> LTC1863 input
+} sim_wiring;
+
+typedef struct sim_board {
+  bool present;
+  uint16_t input[SIM_CHANNELS];   // by LTC2656 address
+  uint16_t output[SIM_CHANNELS];
+  float gain[SIM_CHANNELS];       // A/V, by channel
+  float offset[SIM_CHANNELS];     // V, what calibration has to find as zeroPoint
+  uint8_t adcNext;                // mux input of the conversion in progress
+  uint32_t frames;
+  uint32_t latches;
+} sim_board;
+
+typedef struct sim_profile {
+  uint64_t count;
+  uint64_t simNs;
+  uint64_t simMaxNs;
+  uint64_t hostNs;
+  uint64_t hostMaxNs;
+} sim_profile;
+
+extern sim_wiring simWiring;
+extern sim_board simBoards[SIM_BOARDS];
+extern sim_profile simTriggerProfile;  // every run of the trigger bottom half, software_isr
+extern uint64_t simSpiWords;
+extern uint64_t simBadFrames;          // DAC frames that were not two words
+extern uint64_t simSlaveGarbage;       // SPI1 words clocked while no ADC was selected
+extern float simAdcNoise;              // uniform +- LSB
+
+// clock
+uint64_t sim_now_ns();
+void sim_advance_ns(uint64_t ns);
+bool sim_idle();  // jump to the next event; false if nothing is scheduled
+void sim_isr(void (*fn)(void), uint8_t priority);  // run fn as an interrupt, e.g. DMA completion
+
+// hardware
+void sim_reset(uint32_t seed);
+float sim_current(int address, int channel);
+bool sim_select_dac();
+
+// trigger edges on pin, count of them period apart from start
+void sim_trigger(uint8_t pin, uint64_t startNs, uint64_t periodNs, uint64_t count);
+uint64_t sim_trigger_left();
+uint64_t sim_trigger_lost();  // edges while nothing was attached to the pin
+void sim_pin_edge(uint8_t pin, uint64_t atNs);  // one falling edge, e.g. the emergency switch
+
+// SPI0 frames, called by the simulated T3SPI; divider is the bus clock divider
+void sim_spi_frame(const uint16_t * words, int n, int divider);
+uint16_t sim_slave_pop();
+
+// serial: host -> sketch bytes, and everything the sketch printed since the last take
+void sim_serial_feed(const void * data, size_t length);
+size_t sim_serial_pending();
+std::string sim_serial_take();
+extern bool simSerialEcho;
+
+#endif
@@ -0,0 +1,798 @@
+/* shim_sim: the sketch on the host, against the board model in sim.cpp.
+
+   Brings the firmware up, optionally sets a topology and calibrates, uploads
+   a table through the legacy header path ('\x01', header, floats), optionally
+   uploads it again deduplicated through UPLOAD_BEGIN/UPLOAD_BULK, arms the
+   trigger and replays edges at a fixed TR, optionally cut short by an
+   emergency zero, then reports per trigger cost, desyncs and table sizes.
+   See README.md. */
+
+#include <Arduino.h>
+
+#include "../shim_arduino.ino"
+#include "sim.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef struct sim_options {
+  const char * header = NULL;
+  const char * tablePath = NULL;
+  int boards = 0;            // 0 keeps the firmware's default topology
+  bool calibrate = false;
+  bool dedup = false;
+  long long triggers = -1;   // -1: one pass over the table, at most maxTriggers
+  long long zeroAfter = -1;  // send ZERO_BYTE once this many edges were seen
+  bool zeroPin = false;      // ... or pull the emergency pin instead
+  bool zeroUpload = false;   // cut a bulk upload short with a ZERO_RUN
+  bool stallUpload = false;  // stall a bulk upload past BULK_TIMEOUT_MS, then send the rest
+  bool zeroData = false;     // upload a table full of ZERO_BYTE, which must not zero
+  double pingMs = -1;        // send a CMD_PING frame this far into the replay
+  double trUs = 1000;
+  int dacDiv = -1;
+  int policy = -1;
+  uint32_t seed = 1;
+} sim_options;
+
+static const long long maxTriggers = 1000000;
+
+static void usage() {
+  printf("usage: shim_sim [options]\n"
+         "  --header STR     control header of the table, e.g. 'c8|b2|l200|80|r100000|1|'\n"
+         "  --table FILE     float32 rows of the table, default random currents in +-1 A\n"
+         "  --boards N       N boards of eight channels at select addresses 0..N-1\n"
+         "  --calibrate      run 'C' first and check it against the model\n"
+         "  --dedup          upload the table again as distinct rows plus an index; random\n"
+         "                   tables then repeat the rows of the first block in every block\n"
+         "  --triggers N     edges to replay, default one pass over the table (at most %lld)\n"
+         "  --tr-us F        trigger period, default 1000\n"
+         "  --zero-after N   emergency zero (ZERO_BYTE) once N edges were seen\n"
+         "  --zero-pin       zero from the emergency pin instead, enabled with CMD_SET_EMERGENCY,\n"
+         "                   the edge lands inside the next row write\n"
+         "  --zero-upload    afterwards, cut a bulk upload of the table short with a ZERO_RUN\n"
+         "  --stall-upload   afterwards, stall a bulk upload halfway past the firmware's timeout\n"
+         "  --zero-data      afterwards, upload a code table full of ZERO_BYTE runs as chunks and\n"
+         "                   in bulk, stuffed like the host does; it must not zero\n"
+         "  --ping-ms F      send CMD_PING F ms into the replay, it has to be ACKed while playing\n"
+         "  --dac-div N      DAC SPI clock divider code 0..7, as CMD_SET_SPI_CLOCK\n"
+         "  --policy P       late edge policy, queue or skip, as CMD_SET_TRIGGER\n"
+         "  --seed N         model offsets, gains and noise\n"
+         "  -v               echo everything the firmware prints\n", maxTriggers);
+}
+
+static bool parse_options(int argc, char ** argv, sim_options * o) {
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    bool more = i + 1 < argc;
+    if (a == "-v") {
+      simSerialEcho = true;
+    } else if (a == "--calibrate") {
+      o->calibrate = true;
+    } else if (a == "--dedup") {
+      o->dedup = true;
+    } else if (a == "--zero-pin") {
+      o->zeroPin = true;
+    } else if (a == "--zero-upload") {
+      o->zeroUpload = true;
+    } else if (a == "--stall-upload") {
+      o->stallUpload = true;
+    } else if (a == "--zero-data") {
+      o->zeroData = true;
+    } else if (a == "--header" && more) {
+      o->header = argv[++i];
+    } else if (a == "--table" && more) {
+      o->tablePath = argv[++i];
+    } else if (a == "--boards" && more) {
+      o->boards = atoi(argv[++i]);
+    } else if (a == "--triggers" && more) {
+      o->triggers = atoll(argv[++i]);
+    } else if (a == "--ping-ms" && more) {
+      o->pingMs = atof(argv[++i]);
+    } else if (a == "--zero-after" && more) {
+      o->zeroAfter = atoll(argv[++i]);
+    } else if (a == "--tr-us" && more) {
+      o->trUs = atof(argv[++i]);
+    } else if (a == "--dac-div" && more) {
+      o->dacDiv = atoi(argv[++i]);
+    } else if (a == "--policy" && more) {
+      std::string p = argv[++i];
+      o->policy = (p == "skip") ? TRIGGER_SKIP : TRIGGER_QUEUE;
+    } else if (a == "--seed" && more) {
+      o->seed = strtoul(argv[++i], NULL, 0);
+    } else {
+      usage();
+      return false;
+    }
+  }
+  if (o->boards < 0 || o->boards > MAX_B || o->trUs <= 0 || o->dacDiv > SPI_CLOCK_DIV128
+      || ((o->zeroUpload || o->stallUpload) && !o->header)) {
+    usage();
+    return false;
+  }
+  return true;
+}
+
+static void wire() {
+  simWiring.selectPin0 = selectPin0;
+  simWiring.selectPin1 = selectPin1;
+  simWiring.boardSelect[0] = boardSelect0;
+  simWiring.boardSelect[1] = boardSelect1;
+  simWiring.boardSelect[2] = boardSelect2;
+  simWiring.slaveSelect = CS_BB;
+  for (int c = 0; c < NUM_C; c++) {
+    simWiring.dacAddress[c] = channelMap[c];
+    simWiring.adcMux[c] = channelMap_ADC[c];
+  }
+}
+
+static double ms(uint64_t ns) {
+  return ns / 1e6;
+}
+
+static double us(uint64_t ns) {
+  return ns / 1e3;
+}
+
+static double cycles_us(uint32_t cycles) {
+  return cycles / double(F_CPU / 1000000);
+}
+
+// loop() passes until the firmware printed text, or timeoutMs of simulated time
+static bool run_until(const char * text, double timeoutMs, std::string * out = NULL) {
+  uint64_t deadline = sim_now_ns() + uint64_t(timeoutMs * 1e6);
+  std::string seen;
+  while (sim_now_ns() < deadline) {
+    loop();
+    seen += sim_serial_take();
+    if (seen.find(text) != std::string::npos) {
+      if (out) {
+        *out = seen;
+      }
+      return true;
+    }
+    sim_advance_ns(1000);
+  }
+  printf("timed out waiting for \"%s\"\n", text);
+  return false;
+}
+
+static void send(const char * text) {
+  sim_serial_feed(text, strlen(text));
+}
+
+// what the host sends for frame or stream data, see stuffZeroRuns in shimProtocol.py
+static std::string stuffed(const void * data, size_t n) {
+  const uint8_t * p = (const uint8_t *)data;
+  std::string out;
+  int run = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (run == ZERO_RUN - 1) {
+      out += (char)ZERO_STUFF;
+      run = 0;
+    }
+    out += (char)p[i];
+    run = (p[i] == ZERO_BYTE) ? run + 1 : 0;
+  }
+  return out;
+}
+
+static void send_frame(uint8_t seq, uint8_t cmd, const void * payload = NULL, uint16_t len = 0) {
+  uint8_t head[5] = {FRAME_SYNC, uint8_t(len & 0xFF), uint8_t(len >> 8), seq, cmd};
+  uint16_t crc = crc16(head + 1, 4, 0xFFFF);
+  crc = crc16((const uint8_t *)payload, len, crc);
+  uint8_t tail[2] = {uint8_t(crc & 0xFF), uint8_t(crc >> 8)};
+  std::string body((const char *)head + 1, 4);
+  body.append(len ? (const char *)payload : "", len);
+  body.append((const char *)tail, sizeof(tail));
+  std::string wire = stuffed(body.data(), body.size());
+  sim_serial_feed(head, 1);
+  sim_serial_feed(wire.data(), wire.size());
+}
+
+// seq has to be non zero
+static bool frame_acked(uint8_t seq, double timeoutMs) {
+  const char ack[3] = {FRAME_ACK, (char)seq, 0};
+  return run_until(ack, timeoutMs);
+}
+
+static bool set_boards(int n) {
+  uint8_t payload[1 + MAX_B * (2 + NUM_C)];
+  int len = 0;
+  payload[len++] = n;
+  for (int b = 0; b < n; b++) {
+    payload[len++] = b;
+    payload[len++] = NUM_C;
+    for (int c = 0; c < NUM_C; c++) {
+      payload[len++] = c;
+    }
+  }
+  frame_error err = set_topology(payload, len);
+  if (err != ERR_NONE) {
+    printf("topology: error %d\n", err);
+    return false;
+  }
+  printf("topology: %d boards, %d columns\n", numBoards, numColumns);
+  return true;
+}
+
+static bool calibrate() {
+  uint64_t t0 = sim_now_ns();
+  std::string out;
+  send("C");
+  if (!run_until("Done Calibrating", 120000, &out)) {
+    return false;
+  }
+  int done = 0;
+  int total = 0;
+  const char * p = strstr(out.c_str(), "calibrated ");
+  if (p) {
+    sscanf(p, "calibrated %d of %d", &done, &total);
+  }
+  // zeroPoint has to find the model's offset, gain its gain
+  float gainErr = 0;
+  float zeroErr = 0;
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      if (!calibrationStatus[b][c]) {
+        continue;
+      }
+      const sim_board * sb = &simBoards[boardMap[b]];
+      gainErr = max(gainErr, fabsf(gain[b][c] - sb->gain[c]));
+      zeroErr = max(zeroErr, fabsf(zeroPoint[b][c] - sb->offset[c]));
+    }
+  }
+  printf("calibration: %d of %d channels in %.1f ms, max error gain %.4f A/V, zero %.2f mV\n",
+         done, total, ms(sim_now_ns() - t0), gainErr, zeroErr * 1000);
+  return done == total;
+}
+
+static std::vector<float> table;
+
+static bool upload(const sim_options * o) {
+  uint64_t t0 = sim_now_ns();
+  send("\x01");
+  sim_serial_feed(o->header, strlen(o->header) + 1);
+  while (mode != MODE_BODY) {
+    loop();
+    sim_advance_ns(1000);
+    if (sim_now_ns() - t0 > 10000000000ULL) {
+      printf("upload: header not taken\n");
+      return false;
+    }
+  }
+  // the firmware's own reading of the header decides how many values go in
+  long long rows = 0;
+  for (int i = 0; i < blocks; i++) {
+    rows += lengths[i];
+  }
+  long long values = rows * ctrlChannels;
+  table.assign(values, 0);
+  if (o->tablePath) {
+    FILE * f = fopen(o->tablePath, "rb");
+    size_t got = f ? fread(table.data(), sizeof(float), values, f) : 0;
+    if (f) {
+      fclose(f);
+    }
+    if ((long long)got != values) {
+      printf("upload: %s has %zu of the %lld values the header asks for\n", o->tablePath, got, values);
+      return false;
+    }
+  } else {
+    uint32_t x = o->seed * 2654435761u + 1;
+    for (long long i = 0; i < values; i++) {
+      x = x * 1664525u + 1013904223u;
+      table[i] = (x >> 8) / float(1 << 23) - 1.0f;
+    }
+    // the slices of a multiband protocol: every block plays the rows of the first
+    for (long long i = channels * lengths[0]; o->dedup && i < values; i++) {
+      table[i] = table[i % (channels * lengths[0])];
+    }
+  }
+  sim_serial_feed(table.data(), values * sizeof(float));
+  sim_serial_take();
+  while (mode != MODE_ACCEPT) {
+    loop();
+    sim_advance_ns(1000);
+  }
+  std::string out = sim_serial_take();
+  bool tooBig = out.find("table too big") != std::string::npos;
+  if (out.find("too many channels") != std::string::npos) {
+    printf("table: %d channels, %d columns in the topology, TOO MANY CHANNELS\n", ctrlChannels, numColumns);
+    return false;
+  }
+  printf("table: %d channels, %d blocks, %lld rows, %lld codes of %d in the pool (%.0f%%)%s\n",
+         channels, blocks, rows, values, codePoolLength, 100.0 * values / codePoolLength,
+         tooBig ? ", TOO BIG" : "");
+  printf("       %s a second bank for a streaming upload while playing\n",
+         2 * values <= codePoolLength ? "leaves room for" : "does not leave room for");
+  printf("upload: %lld bytes in %.1f ms\n", values * 4, ms(sim_now_ns() - t0));
+  return !tooBig;
+}
+
+static bool upload_frame(frame_error err, const char * what) {
+  if (err != ERR_NONE) {
+    printf("dedup upload: %s error %d\n", what, err);
+  }
+  return err == ERR_NONE;
+}
+
+// the loaded table again, distinct rows once plus one index entry per row
+static bool upload_dedup() {
+  int rows = table_rows(lengths, blocks);
+  std::map<std::vector<float>, int> seen;
+  std::vector<float> stored;
+  std::vector<uint16_t> index;
+  for (int r = 0; r < rows; r++) {
+    std::vector<float> row(table.begin() + channels * r, table.begin() + channels * (r + 1));
+    auto it = seen.insert(std::make_pair(row, (int)seen.size())).first;
+    if (it->second == (int)stored.size() / channels) {
+      stored.insert(stored.end(), row.begin(), row.end());
+    }
+    index.push_back(it->second);
+  }
+  int distinct = stored.size() / channels;
+  uint8_t indexSize = (distinct <= 256) ? 1 : 2;
+
+  uint8_t begin[3 + 6 * maxBlocks + 3];
+  int len = 0;
+  begin[len++] = UPLOAD_FLOAT32;
+  begin[len++] = channels;
+  begin[len++] = blocks;
+  for (int i = 0; i < blocks; i++) {
+    uint16_t l = lengths[i];
+    memcpy(begin + len, &l, 2);
+    len += 2;
+  }
+  for (int i = 0; i < blocks; i++) {
+    uint32_t r = reps[i];
+    memcpy(begin + len, &r, 4);
+    len += 4;
+  }
+  uint16_t n = distinct;
+  memcpy(begin + len, &n, 2);
+  begin[len + 2] = indexSize;
+  len += 3;
+
+  std::string stream((const char *)stored.data(), stored.size() * sizeof(float));
+  for (uint16_t i : index) {
+    stream.append((const char *)&i, indexSize);
+  }
+  uint8_t bulk[6];
+  uint32_t bytes = stream.size();
+  uint16_t crc = crc16((const uint8_t *)stream.data(), bytes, 0xFFFF);
+  memcpy(bulk, &bytes, 4);
+  memcpy(bulk + 4, &crc, 2);
+
+  // what the flat table plays, to hold the indexed one against
+  std::vector<uint16_t> flat(dacStore, dacStore + dacStoreLength);
+  uint64_t t0 = sim_now_ns();
+  if (!upload_frame(upload_begin(begin, len), "UPLOAD_BEGIN") || !upload_frame(upload_bulk_begin(bulk, 6), "UPLOAD_BULK")) {
+    return false;
+  }
+  std::string wire = stuffed(stream.data(), stream.size());
+  sim_serial_feed(wire.data(), wire.size());
+  while (!upload_bulk_poll()) {
+    sim_advance_ns(1000);
+  }
+  if (!upload_frame(upload_end(), "UPLOAD_END")) {
+    return false;
+  }
+  uint64_t t1 = sim_now_ns();
+  table_swap();
+  int wrong = 0;
+  for (int r = 0; r < rows; r++) {
+    const uint16_t * row = table_row(r);
+    wrong += (row == NULL || memcmp(row, flat.data() + channels * r, 2 * channels) != 0);
+  }
+  int words = table_words(dacStoreLength, tableIndexSize * tableRows);
+  printf("dedup: %d distinct rows of %d, %d-byte index, %d words of the pool (%.0f%%, flat %d)\n",
+         distinct, rows, indexSize, words, 100.0 * words / codePoolLength, (int)flat.size());
+  printf("       %u bytes in %.1f ms, %d rows differ from the flat table\n", bytes, ms(t1 - t0), wrong);
+  return wrong == 0;
+}
+
+static long long table_pass() {
+  long long n = 0;
+  for (int i = 0; i < blocks; i++) {
+    n += (long long)reps[i] * lengths[i];
+  }
+  return n;
+}
+
+static void print_stat(const char * name, stat_id id) {
+  volatile perf_stat * st = &perfStats[id];
+  if (st->count == 0) {
+    return;
+  }
+  printf("  %-16s n %10u  min %8.2f  mean %8.2f  max %8.2f us\n", name, st->count,
+         cycles_us(st->min), cycles_us(uint32_t(st->total / st->count)), cycles_us(st->max));
+}
+
+// every row the trigger played, against the random access playback and the table
+static long long rowsChecked = 0;
+static long long rowsWrong = 0;
+
+static void check_trigger_log() {
+  trigger_record rec;
+  while (triggerLog.pop(rec)) {
+    rowsChecked++;
+    int blk = computeBlockIdx(rec.counter);
+    bool ok = (blk == rec.blk && computeRepIdx(rec.counter, blk) == rec.rep);
+    const uint16_t * row = table_row(block_start_row(rec.blk) + rec.rep);
+    for (int i = 0; ok && row != NULL && i < TRIGGER_LOG_CODES && i < channels; i++) {
+      ok = (row[i] == rec.codes[i]);
+    }
+    if (!ok && rowsWrong++ < 5) {
+      printf("  row %d played block %d rep %d, computeBlockIdx/computeRepIdx say %d/%d\n",
+             rec.counter, rec.blk, rec.rep, blk, (blk >= 0) ? computeRepIdx(rec.counter, blk) : -1);
+    }
+  }
+}
+
+// every channel at its zero code, and the largest current the model makes of them
+static bool check_zero(float * maxI) {
+  bool ok = true;
+  *maxI = 0;
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      ok = ok && simBoards[boardMap[b]].output[channelMap[c]] == zeroCode[b][c];
+      *maxI = max(*maxI, fabsf(sim_current(boardMap[b], c)));
+    }
+  }
+  return ok;
+}
+
+#define PING_SEQ 0x2A
+
+static bool replay(const sim_options * o) {
+  long long pass = table_pass();
+  long long n = (o->triggers >= 0) ? o->triggers : min(pass, maxTriggers);
+  if (o->zeroPin) {
+    uint8_t on = 1;
+    send_frame(0x2B, CMD_SET_EMERGENCY, &on, 1);
+    if (!frame_acked(0x2B, 100)) {
+      return false;
+    }
+  }
+  send("G");
+  if (!run_until("Trigger Armed", 1000)) {
+    return false;
+  }
+  stats_reset();
+  simTriggerProfile = sim_profile();
+  uint64_t periodNs = uint64_t(o->trUs * 1000);
+  uint64_t t0 = sim_now_ns();
+  auto h0 = std::chrono::steady_clock::now();
+  sim_trigger(interruptPin, t0 + periodNs, periodNs, n);
+  uint64_t zeroSentNs = 0;
+  uint64_t zeroDoneNs = 0;
+  uint64_t pingSentNs = 0;
+  uint64_t pingAckNs = 0;
+  uint64_t lastPassNs = sim_now_ns();
+  uint64_t maxGapNs = 0;
+  const char ack[2] = {FRAME_ACK, PING_SEQ};
+  // the main loop gets a pass after every edge and timer tick
+  while (sim_trigger_left() > 0 || stepCount != edgeCount) {
+    if (o->pingMs >= 0 && pingSentNs == 0 && sim_now_ns() - t0 >= uint64_t(o->pingMs * 1e6)) {
+      send_frame(PING_SEQ, CMD_PING);
+      pingSentNs = sim_now_ns();
+    }
+    if (o->zeroAfter >= 0 && zeroSentNs == 0 && statTriggers >= o->zeroAfter) {
+      if (o->zeroPin) {
+        // a microsecond after the next edge, inside its row write
+        zeroSentNs = t0 + periodNs * ((sim_now_ns() - t0) / periodNs + 1) + 1000;
+        sim_pin_edge(emergencyPin, zeroSentNs);
+      } else {
+        uint8_t z = ZERO_BYTE;
+        sim_serial_feed(&z, 1);
+        zeroSentNs = sim_now_ns();
+      }
+    }
+    check_trigger_log();
+    // from one pass to the next, including whatever preempted the last one
+    maxGapNs = max(maxGapNs, sim_now_ns() - lastPassNs);
+    lastPassNs = sim_now_ns();
+    loop();
+    std::string out = sim_serial_take();
+    if (pingSentNs && !pingAckNs && out.find(std::string(ack, 2)) != std::string::npos) {
+      pingAckNs = sim_now_ns();
+    }
+    if (zeroSentNs && !zeroDoneNs && zeroCount > 0) {
+      zeroDoneNs = sim_now_ns();
+    }
+    // the edges left fall on a detached pin
+    if (zeroDoneNs && zeroReported == zeroCount) {
+      sim_advance_ns(sim_trigger_left() * periodNs);
+      break;
+    }
+    if (!sim_idle()) {
+      break;
+    }
+  }
+  maxGapNs = max(maxGapNs, sim_now_ns() - lastPassNs);
+  uint32_t afterZero = statTriggers;
+  sim_advance_ns(periodNs);
+  check_trigger_log();
+  loop();
+  sim_serial_take();
+  double hostS = std::chrono::duration<double>(std::chrono::steady_clock::now() - h0).count();
+  send("H");
+  run_until("Trigger Halted", 1000);
+
+  printf("triggers: %lld edges every %.1f us, one table pass is %lld, %.1f s simulated in %.2f s\n",
+         n, o->trUs, pass, (sim_now_ns() - t0) / 1e9, hostS);
+  printf("  seen %u, never reached the pin interrupt %llu, late %u, desync events %u\n",
+         statTriggers, (unsigned long long)(n - statTriggers), statOverruns, desyncEvents);
+  const sim_profile * p = &simTriggerProfile;
+  if (p->count) {
+    printf("  bottom half      n %10llu  mean %8.2f  max %8.2f us simulated, mean %.2f max %.2f us host\n",
+           (unsigned long long)p->count, us(p->simNs / p->count), us(p->simMaxNs),
+           us(p->hostNs / p->count), us(p->hostMaxNs));
+  }
+  printf("  rows checked %lld, wrong %lld, trigger log records dropped %u\n", rowsChecked, rowsWrong, triggerLog.dropped);
+  printf("  main loop: longest wait for a pass %.1f us\n", us(maxGapNs));
+  bool pingOk = true;
+  if (o->pingMs >= 0 && !pingSentNs) {
+    pingOk = false;
+    printf("ping: never sent, the main loop got no pass from %.1f ms on while the trigger played\n", o->pingMs);
+  } else if (pingSentNs) {
+    pingOk = pingAckNs != 0;
+    if (pingOk) {
+      printf("ping: ACKed %.1f us after it was sent\n", us(pingAckNs - pingSentNs));
+    } else {
+      printf("ping: NEVER ACKED, the main loop did not get to it while the trigger played\n");
+    }
+  }
+  bool zeroOk = true;
+  if (zeroSentNs) {
+    float maxI;
+    uint8_t source = o->zeroPin ? ZERO_PIN : ZERO_SERIAL;
+    zeroOk = zeroDoneNs && check_zero(&maxI) && statTriggers == afterZero && zeroSource == source;
+    printf("zero: from the %s after %u edges, done in %.1f us, %d channels %s their zero code, max |I| %.1f mA\n",
+           (zeroSource == ZERO_PIN) ? "pin" : "serial", statTriggers, us(zeroDoneNs - zeroSentNs), numBoards * NUM_C,
+           check_zero(&maxI) ? "at" : "NOT ALL AT", maxI * 1000);
+    printf("      %llu edges after it found the trigger detached, %u rows played after it\n",
+           (unsigned long long)sim_trigger_lost(), statTriggers - afterZero);
+  }
+  print_stat("setDACVal", STAT_SET_DAC_VAL);
+  print_stat("update_outputs", STAT_UPDATE_OUTPUTS);
+  print_stat("LTC2656Send", STAT_DAC_SEND);
+  print_stat("wave_tick", STAT_WAVE_TICK);
+  print_stat("update_main", STAT_UPDATE_MAIN);
+  if (perfStats[STAT_SET_DAC_VAL].count && cycles_us(perfStats[STAT_SET_DAC_VAL].max) > o->trUs) {
+    printf("  WORST CASE ROW WRITE IS LONGER THAN THE TR\n");
+  }
+  return zeroOk && pingOk;
+}
+
+/* A bulk upload of the table cut short halfway: by the host's ZERO_RUN,
+   followed by the rest its writer still had queued, or by a stall past
+   BULK_TIMEOUT_MS before the rest comes in late. The upload has to be
+   dropped, none of the stream may be read as commands (nothing echoed) and a
+   frame after the line went quiet is answered again. A zero has to leave
+   every coil at zero */
+static bool cut_upload(bool zero) {
+  uint8_t begin[3 + 6 * maxBlocks];
+  int len = 0;
+  begin[len++] = UPLOAD_FLOAT32;
+  begin[len++] = channels;
+  begin[len++] = blocks;
+  for (int i = 0; i < blocks; i++) {
+    uint16_t l = lengths[i];
+    memcpy(begin + len, &l, 2);
+    len += 2;
+  }
+  for (int i = 0; i < blocks; i++) {
+    uint32_t r = reps[i];
+    memcpy(begin + len, &r, 4);
+    len += 4;
+  }
+  uint32_t bytes = table.size() * sizeof(float);
+  uint16_t crc = crc16((const uint8_t *)table.data(), bytes, 0xFFFF);
+  std::string wire = stuffed(table.data(), bytes);
+  const char * stream = wire.data();
+  uint8_t bulk[6];
+  memcpy(bulk, &bytes, 4);
+  memcpy(bulk + 4, &crc, 2);
+  send_frame(1, CMD_UPLOAD_BEGIN, begin, len);
+  if (!frame_acked(1, 100)) {
+    return false;
+  }
+  send_frame(2, CMD_UPLOAD_BULK, bulk, sizeof(bulk));
+  if (!frame_acked(2, 100)) {
+    return false;
+  }
+  uint32_t half = wire.size() / 2;
+  std::string run(ZERO_RUN, (char)ZERO_BYTE);
+  uint32_t before = zeroCount;
+  uint64_t t0 = sim_now_ns();
+  uint64_t zeroNs = 0;
+  sim_serial_feed(stream, half);
+  if (zero) {
+    sim_serial_feed(run.data(), run.size());
+  } else {
+    while (sim_now_ns() - t0 < (BULK_TIMEOUT_MS + 100) * 1000000ULL) {
+      loop();
+      sim_serial_take();
+      sim_advance_ns(1000);
+    }
+  }
+  sim_serial_feed(stream + half, wire.size() - half);
+  std::string echoed;
+  while (mode != MODE_ACCEPT || (zero && zeroCount == before)) {
+    loop();
+    // an EVT_ZERO is all the firmware may send
+    std::string out = sim_serial_take();
+    if (!out.empty() && (uint8_t)out[0] != FRAME_EVENT) {
+      echoed += out;
+    }
+    if (!zeroNs && zeroCount != before) {
+      zeroNs = sim_now_ns();
+    }
+    sim_advance_ns(1000);
+    if (sim_now_ns() - t0 > 5000000000ULL) {
+      printf("cut upload: still in mode %d after 5 s\n", mode);
+      return false;
+    }
+  }
+  uint64_t quietNs = sim_now_ns();
+  // whatever of the stream the firmware took for commands answers by now
+  while (sim_now_ns() - quietNs < 10000000ULL) {
+    loop();
+    std::string out = sim_serial_take();
+    if (!out.empty() && (uint8_t)out[0] != FRAME_EVENT) {
+      echoed += out;
+    }
+    sim_advance_ns(1000);
+  }
+  send_frame(3, CMD_PING);
+  bool answered = frame_acked(3, 100);
+  bool ok = answered && !uploadActive && !stagedReady && echoed.empty();
+  if (zero) {
+    float maxI;
+    bool zeroed = check_zero(&maxI);
+    printf("zero upload: run after %u of %u stream bytes, zeroed %.1f ms in, %d channels %s their zero code, max |I| %.1f mA\n",
+           half, (unsigned)wire.size(), ms(zeroNs - t0), numBoards * NUM_C, zeroed ? "at" : "NOT ALL AT", maxI * 1000);
+    ok = ok && zeroed && zeroCount == before + 1;
+  } else {
+    printf("stall upload: %u of %u stream bytes, the rest %d ms later\n", half, (unsigned)wire.size(), BULK_TIMEOUT_MS + 100);
+    ok = ok && zeroCount == before;
+  }
+  printf("             upload %s, %zu bytes of it read as commands, reading commands again after %.1f ms, a ping then %s\n",
+         (uploadActive || stagedReady) ? "STILL ACTIVE" : "dropped", echoed.size(), ms(quietNs - t0),
+         answered ? "ACKed" : "NOT ACKED");
+  return ok;
+}
+
+/* A code table that is mostly ZERO_BYTE: a stored row of 0x1818 codes, the
+   1-byte index naming that row (24) sixteen times over, sent stuffed as
+   UPLOAD_CHUNK frames and then as a bulk stream. Neither may zero, and both
+   have to play exactly the rows that went in */
+static bool zero_data() {
+  const int ch = numColumns;
+  const int rows = 47;
+  const int distinct = 32;
+  std::vector<uint16_t> codes;
+  for (int r = 0; r < distinct; r++) {
+    for (int c = 0; c < ch; c++) {
+      codes.push_back((r == ZERO_BYTE) ? 0x1818 : 0x1000 + 16 * r + c);
+    }
+  }
+  std::vector<uint8_t> index;
+  for (int r = 0; r < rows; r++) {
+    index.push_back((r < ZERO_BYTE) ? r : (r < ZERO_BYTE + 16) ? ZERO_BYTE : r - 15);
+  }
+  uint8_t begin[14];
+  uint16_t l = rows;
+  uint32_t rep = 1;
+  uint16_t n = distinct;
+  begin[0] = UPLOAD_CODES;
+  begin[1] = ch;
+  begin[2] = 1;
+  memcpy(begin + 3, &l, 2);
+  memcpy(begin + 5, &rep, 4);
+  memcpy(begin + 9, &calibrationEpoch, 2);
+  memcpy(begin + 11, &n, 2);
+  begin[13] = 1;
+  std::string stream((const char *)codes.data(), 2 * codes.size());
+  stream.append((const char *)index.data(), index.size());
+
+  uint32_t before = zeroCount;
+  bool ok = true;
+  uint8_t seq = 0x40;
+  for (int bulk = 0; bulk < 2 && ok; bulk++) {
+    send_frame(++seq, CMD_UPLOAD_BEGIN, begin, sizeof(begin));
+    ok = frame_acked(seq, 100);
+    if (bulk) {
+      uint8_t head[6];
+      uint32_t bytes = stream.size();
+      uint16_t crc = crc16((const uint8_t *)stream.data(), bytes, 0xFFFF);
+      memcpy(head, &bytes, 4);
+      memcpy(head + 4, &crc, 2);
+      send_frame(++seq, CMD_UPLOAD_BULK, head, sizeof(head));
+      ok = ok && frame_acked(seq, 100);
+      std::string wire = stuffed(stream.data(), stream.size());
+      sim_serial_feed(wire.data(), wire.size());
+    } else {
+      // 64 codes a chunk, then the index in one
+      for (int item = 0; ok && item < (int)codes.size() + rows;) {
+        bool isCode = item < (int)codes.size();
+        int count = isCode ? min((int)codes.size() - item, 64) : rows;
+        int bytes = isCode ? 2 * count : count;
+        const char * at = stream.data() + (isCode ? 2 * item : 2 * codes.size());
+        uint8_t chunk[2 + 128];
+        uint16_t offset = item;
+        memcpy(chunk, &offset, 2);
+        memcpy(chunk + 2, at, bytes);
+        send_frame(++seq, CMD_UPLOAD_CHUNK, chunk, 2 + bytes);
+        ok = frame_acked(seq, 100);
+        item += count;
+      }
+    }
+    uint8_t hold = 1;
+    send_frame(++seq, CMD_UPLOAD_END, &hold, 1);
+    ok = ok && frame_acked(seq, 100);
+    int wrong = 0;
+    if (ok) {
+      table_swap();
+      for (int r = 0; r < rows; r++) {
+        const uint16_t * row = table_row(r);
+        wrong += (row == NULL || memcmp(row, codes.data() + ch * index[r], 2 * ch) != 0);
+      }
+    }
+    printf("zero data: %s of %zu bytes, %s, %d of %d rows differ, %s\n", bulk ? "bulk stream" : "chunk frames",
+           stream.size(), ok ? "ACKed" : "NOT ACKED", wrong, rows, (zeroCount == before) ? "no zero" : "ZEROED");
+    ok = ok && wrong == 0 && zeroCount == before;
+  }
+  return ok;
+}
+
+int main(int argc, char ** argv) {
+  sim_options o;
+  if (!parse_options(argc, argv, &o)) {
+    return 2;
+  }
+  wire();
+  sim_reset(o.seed);
+  setup();
+  sim_serial_take();
+  printf("firmware up after %.1f ms\n", ms(sim_now_ns()));
+
+  bool ok = true;
+  if (o.boards > 0) {
+    ok = ok && set_boards(o.boards);
+  }
+  if (o.dacDiv >= 0) {
+    spiSetClocks(o.dacDiv, adcClockDiv);
+  }
+  if (o.policy >= 0) {
+    triggerPolicy = (trigger_policy)o.policy;
+  }
+  if (ok && o.calibrate) {
+    ok = calibrate();
+  }
+  if (ok && o.header) {
+    ok = upload(&o);
+  }
+  if (ok && o.header && o.dedup) {
+    ok = upload_dedup();
+  }
+  if (ok) {
+    ok = replay(&o);
+  }
+  if (ok && o.zeroUpload) {
+    ok = cut_upload(true);
+  }
+  if (ok && o.stallUpload) {
+    ok = cut_upload(false);
+  }
+  if (ok && o.zeroData) {
+    ok = zero_data();
+  }
+  printf("spi: %llu words, %llu malformed DAC frames, %llu words to SPI1 with no ADC selected\n",
+         (unsigned long long)simSpiWords, (unsigned long long)simBadFrames,
+         (unsigned long long)simSlaveGarbage);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+/* T3SPI for the simulator: the same interface as t3spi.cpp, but every frame
+   goes to the board model in sim.cpp instead of the SPI registers. DMA
+   transfers finish before txPUSHR_dma returns and their callback runs as a
+   DMA interrupt right away, so firmware that spins on a DMA flag never
+   waits on a clock that cannot move. */
+
+#include <Arduino.h>
+
+#include "../t3spi.h"
+#include "sim.h"
+
+#define SIM_DMA_PRIORITY 128
+
+// SPI_CLOCK_DIVn code -> divider of the bus clock
+static const uint8_t clockDivider[] = {2, 4, 6, 8, 16, 32, 64, 128};
+static uint8_t ctarDivider[2] = {4, 4};
+
+T3SPI::T3SPI(KINETISK_SPI_t * spi_used) {
+  SPIx = spi_used;
+  dataPointer = 0;
+  packetCT = 0;
+  wordCT = 0;
+  data16 = 0;
+  ctar = 0;
+  dmaActive = false;
+  dmaTx = NULL;
+  dmaCallback = NULL;
+}
+
+void T3SPI::begin_MASTER() {
+}
+
+void T3SPI::begin_MASTER(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs, bool activeState) {
+}
+
+void T3SPI::setCTAR(bool CTARn, uint8_t size, uint8_t dataMode, uint8_t bo, uint8_t cdiv) {
+  ctarDivider[CTARn] = clockDivider[cdiv & 7];
+}
+
+void T3SPI::enableCS(uint8_t cs, bool activeState) {
+}
+
+void T3SPI::tx16(volatile uint16_t * dataOUT, int length, bool CTARn, uint8_t PCS) {
+  for (int i = 0; i < length; i++) {
+    uint16_t w = dataOUT[i];
+    sim_spi_frame(&w, 1, ctarDivider[CTARn]);
+  }
+  wordCT += length;
+  packetCT++;
+}
+
+void T3SPI::tx16_burst(volatile uint16_t * dataOUT, int length, bool CTARn, uint8_t PCS, int frameLength) {
+  if (length <= 0) {
+    return;
+  }
+  if (frameLength <= 0) {
+    frameLength = length;
+  }
+  uint16_t frame[maxDataLength];
+  for (int i = 0; i < length; i += frameLength) {
+    int n = min(frameLength, length - i);
+    for (int k = 0; k < n; k++) {
+      frame[k] = dataOUT[i + k];
+    }
+    sim_spi_frame(frame, n, ctarDivider[CTARn]);
+  }
+  wordCT += length;
+  packetCT++;
+}
+
+void T3SPI::txrx16(volatile uint16_t * dataOUT, volatile uint16_t * dataIN, int length, bool CTARn, uint8_t PCS) {
+  tx16(dataOUT, length, CTARn, PCS);
+  for (int i = 0; i < length; i++) {
+    dataIN[i] = 0xFFFF; // nothing drives SPI0 MISO, readback comes in on SPI1
+  }
+}
+
+void T3SPI::tx16_dma(volatile uint16_t * dataOUT, int length, bool CTARn, uint8_t PCS, void (*callback)(void), int frameLength) {
+  dmaActive = true;
+  tx16_burst(dataOUT, min(length, maxDataLength), CTARn, PCS, frameLength);
+  dmaFinish();
+  if (callback) {
+    sim_isr(callback, SIM_DMA_PRIORITY);
+  }
+}
+
+// frames end at the first word without CONT, each word carries its CTAR
+void T3SPI::txPUSHR_dma(volatile uint32_t * pushr, int length, void (*callback)(void)) {
+  if (length <= 0) {
+    return;
+  }
+  dmaActive = true;
+  uint16_t frame[maxDataLength];
+  int n = 0;
+  for (int i = 0; i < length; i++) {
+    uint32_t w = pushr[i];
+    frame[n++] = w & 0xFFFF;
+    if (!(w & SPI_PUSHR_CONT) || i == length - 1 || n == maxDataLength) {
+      sim_spi_frame(frame, n, ctarDivider[(w >> 28) & 1]);
+      n = 0;
+    }
+  }
+  wordCT += length;
+  packetCT++;
+  dmaFinish();
+  if (callback) {
+    sim_isr(callback, SIM_DMA_PRIORITY);
+  }
+}
+
+void T3SPI::waitDMA() {
+}
+
+void T3SPI::dmaFinish() {
+  dmaActive = false;
+}
+
+// transfers never outlast txPUSHR_dma here, so there is nothing in flight to stop
+void T3SPI::abortDMA() {
+  dmaActive = false;
+}
+
+void T3SPI::begin_SLAVE() {
+}
+
+void T3SPI::begin_SLAVE(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs) {
+}
+
+void T3SPI::setCTAR_SLAVE(uint8_t size, uint8_t dataMode) {
+}
+
+void T3SPI::rx16(volatile uint16_t * dataIN, int length) {
+  dataIN[dataPointer] = sim_slave_pop();
+  dataPointer++;
+  wordCT++;
+  if (dataPointer == length) {
+    dataPointer = 0;
+    packetCT++;
+  }
+}
+
+void T3SPI::start() {
+}
+
+void T3SPI::stop() {
+}
+
+void T3SPI::end() {
+}
@@ -0,0 +1,68 @@
+#ifndef _sim_Arduino_h
+#define _sim_Arduino_h
+
+/* Just enough of the Teensyduino core for the sketch, see sim.cpp */
+
+#include "core_pins.h"
+#include "mk20dx128.h"
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class usb_serial_class {
+public:
+  void begin(long baud) {}
+  int available();
+  int read();
+  int peek();
+  size_t readBytes(char * buffer, size_t length);
+  size_t readBytesUntil(char terminator, char * buffer, size_t length);
+  void setTimeout(long ms) { timeoutMs = ms; }
+
+  size_t write(uint8_t b) { return write(&b, 1); }
+  size_t write(const uint8_t * buffer, size_t size);
+  size_t write(const char * buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+  size_t print(const char * s) { return write(s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int n) { return print((long)n); }
+  size_t print(unsigned int n) { return print((unsigned long)n); }
+  size_t print(long n);
+  size_t print(unsigned long n);
+  size_t print(double n, int digits = 2);
+
+  size_t println() { return print("\r\n"); }
+  template <typename T> size_t println(T value) { return print(value) + println(); }
+  size_t println(double n, int digits) { return print(n, digits) + println(); }
+
+  long timeoutMs = 1000;
+};
+
+extern usb_serial_class Serial;
+
+// PIT channels, fired from the simulated clock at their NVIC priority
+class IntervalTimer {
+public:
+  bool begin(void (*function)(), unsigned int us) { return start(function, us * 1000ULL); }
+  bool begin(void (*function)(), int us) { return start(function, us * 1000ULL); }
+  bool begin(void (*function)(), unsigned long us) { return start(function, us * 1000ULL); }
+  bool begin(void (*function)(), float us) { return start(function, uint64_t(us * 1000.0f)); }
+  void end();
+  void priority(uint8_t n) { prio = n; }
+  ~IntervalTimer() { end(); }
+
+  void (*callback)() = NULL;
+  uint64_t periodNs = 0;
+  uint64_t nextNs = 0;
+  uint8_t prio = 128;
+  bool active = false;
+  bool pending = false;
+
+private:
+  bool start(void (*function)(), uint64_t ns);
+};
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _sim_DMAChannel_h
+#define _sim_DMAChannel_h
+
+// t3spi.h only keeps a pointer; the simulated T3SPI completes DMA by itself
+class DMAChannel;
+
+#endif
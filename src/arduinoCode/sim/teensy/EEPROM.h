@@ -0,0 +1,28 @@
+#ifndef _sim_EEPROM_h
+#define _sim_EEPROM_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define SIM_EEPROM_SIZE 2048 // Teensy 3.2
+
+extern uint8_t simEeprom[SIM_EEPROM_SIZE];
+
+struct EEPROMClass {
+  uint8_t read(int idx) { return simEeprom[idx]; }
+  void write(int idx, uint8_t value) { simEeprom[idx] = value; }
+  void update(int idx, uint8_t value) { simEeprom[idx] = value; }
+  uint16_t length() { return SIM_EEPROM_SIZE; }
+  template <typename T> T & get(int idx, T & t) {
+    memcpy(&t, simEeprom + idx, sizeof(T));
+    return t;
+  }
+  template <typename T> const T & put(int idx, const T & t) {
+    memcpy(simEeprom + idx, &t, sizeof(T));
+    return t;
+  }
+};
+
+static EEPROMClass EEPROM;
+
+#endif
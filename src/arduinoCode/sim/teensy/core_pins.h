@@ -0,0 +1,29 @@
+#ifndef _sim_core_pins_h
+#define _sim_core_pins_h
+
+#include "kinetis.h"
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define FALLING 2
+#define RISING 3
+#define CHANGE 4
+
+#define CORE_NUM_DIGITAL 64
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+void digitalWriteFast(uint8_t pin, uint8_t value);
+uint8_t digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*function)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+uint32_t millis(void);
+uint32_t micros(void);
+
+#endif
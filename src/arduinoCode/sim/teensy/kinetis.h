@@ -0,0 +1,71 @@
+#ifndef _sim_kinetis_h
+#define _sim_kinetis_h
+
+/* The registers and NVIC macros the sketch touches, backed by sim.cpp */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define F_CPU 96000000
+#define F_BUS 48000000
+
+typedef struct {
+  volatile uint32_t MCR;
+  volatile uint32_t unused1;
+  volatile uint32_t TCR;
+  volatile uint32_t CTAR0;
+  volatile uint32_t CTAR1;
+  volatile uint32_t unused2[6];
+  volatile uint32_t SR;
+  volatile uint32_t RSER;
+  volatile uint32_t PUSHR;
+  volatile uint32_t POPR;
+} KINETISK_SPI_t;
+
+extern KINETISK_SPI_t KINETISK_SPI0;
+extern KINETISK_SPI_t KINETISK_SPI1;
+#define SPI0_SR KINETISK_SPI0.SR
+
+#define SPI_SR_TCF      0x80000000
+#define SPI_SR_EOQF     0x10000000
+#define SPI_SR_RFDF     0x00020000
+#define SPI_PUSHR_CONT  0x80000000
+#define SPI_PUSHR_EOQ   0x08000000
+#define SPI_PUSHR_CTAS(n) (((n) & 7) << 28)
+#define SPI_PUSHR_PCS(n)  (((n) & 31) << 16)
+
+#define IRQ_SPI0     26
+#define IRQ_SPI1     27
+#define IRQ_PORTA    59
+#define IRQ_SOFTWARE 94
+#define NVIC_NUM_INTERRUPTS 95
+
+void sim_irq_enable(int irq, bool on);
+void sim_irq_pend(int irq);
+void sim_irq_unpend(int irq);
+void sim_irq_priority(int irq, uint8_t priority);
+void sim_irq_off(bool off);
+
+#define NVIC_ENABLE_IRQ(n)        sim_irq_enable((n), true)
+#define NVIC_DISABLE_IRQ(n)       sim_irq_enable((n), false)
+#define NVIC_SET_PENDING(n)       sim_irq_pend(n)
+#define NVIC_CLEAR_PENDING(n)     sim_irq_unpend(n)
+#define NVIC_SET_PRIORITY(n, p)   sim_irq_priority((n), (p))
+
+#define __disable_irq() sim_irq_off(true)
+#define __enable_irq()  sim_irq_off(false)
+#define cli() __disable_irq()
+#define sei() __enable_irq()
+
+// kept in step with the simulated clock
+extern volatile uint32_t ARM_DWT_CYCCNT;
+extern volatile uint32_t ARM_DEMCR;
+extern volatile uint32_t ARM_DWT_CTRL;
+#define ARM_DEMCR_TRCENA        (1 << 24)
+#define ARM_DWT_CTRL_CYCCNTENA  (1 << 0)
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _sim_mk20dx128_h
+#define _sim_mk20dx128_h
+
+#include "kinetis.h"
+
+// vector table entries the sketch defines, dispatched by sim.cpp
+#ifdef __cplusplus
+extern "C" {
+#endif
+void software_isr(void);
+void spi1_isr(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
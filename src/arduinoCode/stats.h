@@ -0,0 +1,120 @@
+/******************************************************/
+/*********************** STATISTICS *******************/
+/******************************************************/
+
+/* Cycle counter (DWT_CYCCNT) timing of the hot paths. Each stat keeps
+   count/min/max/total in cycles and a log2 histogram in microseconds:
+   bin 0 is < 1us, bin k is [2^(k-1), 2^k) us, the last bin is everything
+   longer. Reported with CMD_GET_STATS. */
+
+#define STAT_BINS 12
+
+typedef enum stat_id {
+  STAT_SET_DAC_VAL,     // whole trigger interrupt
+  STAT_UPDATE_OUTPUTS,  // one row to every board
+  STAT_DAC_SEND,        // one LTC2656 command frame
+  STAT_ADC_READ,        // one blocking oversampled read
+  STAT_WAVE_TICK,       // one waveform step, CPU side of the DMA row write
+  STAT_UPDATE_MAIN,     // update_outputs_row from the main loop ('M', bench)
+  STAT_COUNT
+} stat_id;
+
+typedef struct perf_stat {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t hist[STAT_BINS];
+} perf_stat;
+
+volatile perf_stat perfStats[STAT_COUNT];
+volatile uint32_t statTriggers = 0;
+volatile uint32_t statOverruns = 0;   // edges that arrived before the previous row was written
+volatile uint32_t statWaveSkips = 0;  // waveform steps dropped while the previous one was on the wire
+
+void stats_reset() {
+  cli();
+  for (int i = 0; i < STAT_COUNT; i++) {
+    perfStats[i].count = 0;
+    perfStats[i].min = 0xFFFFFFFF;
+    perfStats[i].max = 0;
+    perfStats[i].total = 0;
+    for (int k = 0; k < STAT_BINS; k++) {
+      perfStats[i].hist[k] = 0;
+    }
+  }
+  statTriggers = 0;
+  statOverruns = 0;
+  statWaveSkips = 0;
+  sei();
+}
+
+void stats_init() {
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  stats_reset();
+}
+
+inline uint32_t stat_begin() {
+  return ARM_DWT_CYCCNT;
+}
+
+// not reentrant: a stat is only ended from one interrupt level, see STAT_UPDATE_MAIN
+inline void stat_end(stat_id id, uint32_t start) {
+  uint32_t cycles = ARM_DWT_CYCCNT - start;
+  volatile perf_stat * st = &perfStats[id];
+  st->count++;
+  st->total += cycles;
+  if (cycles < st->min) {
+    st->min = cycles;
+  }
+  if (cycles > st->max) {
+    st->max = cycles;
+  }
+  uint32_t us = cycles / (F_CPU / 1000000);
+  int bin = 0;
+  while (us > 0 && bin < STAT_BINS - 1) {
+    us >>= 1;
+    bin++;
+  }
+  st->hist[bin]++;
+}
+
+void stat_put32(uint8_t * &p, uint32_t v) {
+  memcpy(p, &v, 4);
+  p += 4;
+}
+
+/* CMD_GET_STATS reply, little endian u32 fields:
+   [F_CPU][triggers][overruns][spi master words][spi slave words][adc timeouts]
+   [u8 STAT_COUNT][u8 STAT_BINS] then per stat [count][min][max][mean][hist x STAT_BINS]
+   then [wave skips]. min/max/mean are in cycles. Returns the payload length */
+int stats_pack(uint8_t * out, uint32_t spiTx, uint32_t spiRx, uint32_t adcTimeouts) {
+  perf_stat snap[STAT_COUNT];
+  cli();
+  memcpy(snap, (const void *)perfStats, sizeof(snap));
+  uint32_t triggers = statTriggers;
+  uint32_t overruns = statOverruns;
+  uint32_t waveSkips = statWaveSkips;
+  sei();
+  uint8_t * p = out;
+  stat_put32(p, F_CPU);
+  stat_put32(p, triggers);
+  stat_put32(p, overruns);
+  stat_put32(p, spiTx);
+  stat_put32(p, spiRx);
+  stat_put32(p, adcTimeouts);
+  *p++ = STAT_COUNT;
+  *p++ = STAT_BINS;
+  for (int i = 0; i < STAT_COUNT; i++) {
+    stat_put32(p, snap[i].count);
+    stat_put32(p, snap[i].count ? snap[i].min : 0);
+    stat_put32(p, snap[i].max);
+    stat_put32(p, snap[i].count ? uint32_t(snap[i].total / snap[i].count) : 0);
+    for (int k = 0; k < STAT_BINS; k++) {
+      stat_put32(p, snap[i].hist[k]);
+    }
+  }
+  stat_put32(p, waveSkips);
+  return p - out;
+}
@@ -4,6 +4,10 @@
 #include "core_pins.h"
 #include <kinetis.h>
 
+//only one DMA transfer can be in flight, so the PUSHR image and its owner are shared
+static volatile uint32_t dmaBuffer[maxDataLength];
+static T3SPI * dmaOwner = NULL;
+
 
 T3SPI::T3SPI(KINETISK_SPI_t * spi_used) {
 	SIM_SCGC6 |= SIM_SCGC6_SPI0;	// enable clock to SPI.
@@ -11,7 +15,11 @@ T3SPI::T3SPI(KINETISK_SPI_t * spi_used) {
 
 	dataPointer=0;
 	packetCT=0;
+	wordCT=0;
 	ctar=0;
+	dmaActive=false;
+	dmaTx=NULL;
+	dmaCallback=NULL;
 	SPIx = spi_used;
 	delay(1000);
 }
@@ -300,6 +308,7 @@ void T3SPI::tx8(volatile uint8_t *dataOUT,   int length, bool CTARn, uint8_t PCS
 	for (int i=0; i < length; i++){
 		SPI_WRITE_8(dataOUT[i], CTARn, PCS, SPIx);
 		SPI_WAIT(SPIx);}
+	wordCT += length;
 	packetCT++;
 }
 
@@ -309,9 +318,112 @@ void T3SPI::tx16(volatile uint16_t *dataOUT, int length, bool CTARn, uint8_t PCS
 	for (int i=0; i < length; i++){
 		SPI_WRITE_16(dataOUT[i], CTARn, PCS, SPIx);
 		SPI_WAIT(SPIx);}
+	wordCT += length;
+	packetCT++;
+}
+
+//TRANSMIT PACKET OF 16 BIT DATA AS ONE BURST
+//the FIFO is kept full and CS stays asserted (CONT) within every frameLength words,
+//so the only wait is for the end of queue. frameLength 0 keeps CS for the whole packet
+void T3SPI::tx16_burst(volatile uint16_t *dataOUT, int length, bool CTARn, uint8_t PCS, int frameLength){
+	if (length <= 0){
+		return;}
+	if (frameLength <= 0){
+		frameLength = length;}
+	SPIx->SR = SPI_SR_EOQF | SPI_SR_TCF;
+	for (int i=0; i < length; i++){
+		uint32_t w = SPI_PUSHR_16(dataOUT[i], CTARn, PCS);
+		if ((i + 1) % frameLength != 0){
+			w |= SPI_PUSHR_CONT;}
+		if (i == length - 1){
+			w |= SPI_PUSHR_EOQ;}
+		while ((SPIx->SR & SPI_SR_TXCTR) >= 0x00004000);
+		SPIx->PUSHR = w;}
+	while (!(SPIx->SR & SPI_SR_EOQF));
+	SPIx->SR = SPI_SR_EOQF | SPI_SR_TCF;
+	wordCT += length;
+	packetCT++;
+}
+
+//TRANSMIT PACKET OF 16 BIT DATA OVER DMA, framed like tx16_burst
+void T3SPI::tx16_dma(volatile uint16_t *dataOUT, int length, bool CTARn, uint8_t PCS, void (*callback)(void), int frameLength){
+	if (length > maxDataLength){
+		length = maxDataLength;}
+	if (frameLength <= 0){
+		frameLength = length;}
+	waitDMA();
+	for (int i=0; i < length; i++){
+		dmaBuffer[i] = SPI_PUSHR_16(dataOUT[i], CTARn, PCS);
+		if ((i + 1) % frameLength != 0){
+			dmaBuffer[i] |= SPI_PUSHR_CONT;}}
+	txPUSHR_dma(dmaBuffer, length, callback);
+}
+
+//TRANSMIT A PREBUILT PUSHR IMAGE (data | CTAS | PCS | CONT) OVER DMA
+void T3SPI::txPUSHR_dma(volatile uint32_t *pushr, int length, void (*callback)(void)){
+	if (length <= 0){
+		return;}
+	waitDMA();
+	if (dmaTx == NULL){
+		dmaTx = new DMAChannel();
+		dmaTx->destination(SPIx->PUSHR);
+		dmaTx->transferSize(4);
+		dmaTx->triggerAtHardwareEvent(DMAMUX_SOURCE_SPI0_TX);
+		dmaTx->disableOnCompletion();
+		dmaTx->interruptAtCompletion();
+		dmaTx->attachInterrupt(dma_tx_isr);
+		NVIC_ENABLE_IRQ(IRQ_SPI0);}
+	//the end of queue flag raises spi0_isr once the last word has been shifted out
+	pushr[length-1] |= SPI_PUSHR_EOQ;
+	dmaOwner = this;
+	dmaCallback = callback;
+	dmaActive = true;
+	SPIx->SR = SPI_SR_EOQF;
+	dmaTx->sourceBuffer(pushr, length * 4);
+	SPIx->RSER = (SPIx->RSER & ~SPI_RSER_EOQF_RE) | SPI_RSER_TFFF_RE | SPI_RSER_TFFF_DIRS;
+	dmaTx->enable();
+	wordCT += length;
 	packetCT++;
 }
 
+void T3SPI::waitDMA(){
+	while (dmaActive);
+}
+
+//called from interrupt context when the queue has drained
+void T3SPI::dmaFinish(){
+	SPIx->RSER &= ~SPI_RSER_EOQF_RE;
+	SPIx->SR = SPI_SR_EOQF;
+	dmaActive = false;
+	if (dmaCallback != NULL){
+		dmaCallback();}
+}
+
+//stop a transfer part way from an interrupt above the DMA's, dropping the queued words; no callback
+void T3SPI::abortDMA(){
+	if (!dmaActive){
+		return;}
+	dmaTx->disable();
+	dmaTx->clearInterrupt();
+	SPIx->RSER &= ~(SPI_RSER_TFFF_RE | SPI_RSER_TFFF_DIRS | SPI_RSER_EOQF_RE);
+	SPIx->MCR |= SPI_MCR_HALT;
+	SPIx->MCR |= SPI_MCR_CLR_TXF | SPI_MCR_CLR_RXF;
+	SPIx->SR = SPI_SR_EOQF | SPI_SR_TCF;
+	SPIx->MCR &= ~SPI_MCR_HALT;
+	dmaActive = false;
+}
+
+//DMA has pushed the last word into the FIFO, wait for it to leave
+void dma_tx_isr(void){
+	dmaOwner->dmaTx->clearInterrupt();
+	dmaOwner->SPIx->RSER = (dmaOwner->SPIx->RSER & ~(SPI_RSER_TFFF_RE | SPI_RSER_TFFF_DIRS)) | SPI_RSER_EOQF_RE;
+}
+
+void spi0_isr(void){
+	if ((dmaOwner != NULL) && (dmaOwner->SPIx->SR & SPI_SR_EOQF)){
+		dmaOwner->dmaFinish();}
+}
+
 //TRANSMIT & RECEIVE PACKET OF 8 BIT DATA
 void T3SPI::txrx8(volatile uint8_t *dataOUT, volatile uint8_t *dataIN, int length, bool CTARn, uint8_t PCS){
 	ctar=CTARn;
@@ -322,6 +434,7 @@ void T3SPI::txrx8(volatile uint8_t *dataOUT, volatile uint8_t *dataIN, int lengt
 		delayMicroseconds(1);
 		dataIN[i]=SPIx->POPR;
 		}
+	wordCT += length;
 	packetCT++;
 }
 
@@ -335,12 +448,14 @@ void T3SPI::txrx16(volatile uint16_t *dataOUT, volatile uint16_t *dataIN, int le
 		delayMicroseconds(1);
 		dataIN[i]=SPIx->POPR;
 		}
+	wordCT += length;
 	packetCT++;
 }
 
 void T3SPI::rx8(volatile uint8_t *dataIN, int length){
 	dataIN[dataPointer] = SPIx->POPR;
 	dataPointer++;
+	wordCT++;
 	if (dataPointer == length){
 		dataPointer=0;
 		packetCT++;}
@@ -350,6 +465,7 @@ void T3SPI::rx8(volatile uint8_t *dataIN, int length){
 void T3SPI::rx16(volatile uint16_t *dataIN, int length){
 	dataIN[dataPointer] = SPIx->POPR;
 	dataPointer++;
+	wordCT++;
 	if (dataPointer == length){
 		dataPointer=0;
 		packetCT++;}
@@ -359,6 +475,7 @@ void T3SPI::rx16(volatile uint16_t *dataIN, int length){
 void T3SPI::rxtx8(volatile uint8_t *dataIN, volatile uint8_t *dataOUT, int length){
 	dataIN[dataPointer] = SPIx->POPR;
 	dataPointer++;
+	wordCT++;
 	if (dataPointer == length){
 		dataPointer=0;
 		packetCT++;}
@@ -369,6 +486,7 @@ void T3SPI::rxtx8(volatile uint8_t *dataIN, volatile uint8_t *dataOUT, int lengt
 void T3SPI::rxtx16(volatile uint16_t *dataIN, volatile uint16_t *dataOUT, int length){
 	dataIN[dataPointer] = SPIx->POPR;
 	dataPointer++;
+	wordCT++;
 	if (dataPointer == length){
 		dataPointer=0;
 		packetCT++;}
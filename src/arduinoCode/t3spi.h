@@ -4,6 +4,7 @@
 #include "mk20dx128.h"
 #include "core_pins.h"
 #include "kinetis.h"
+#include "DMAChannel.h"
 
 #define maxDataLength		256
 
@@ -74,6 +75,10 @@
 	} while(0)
 
 
+#define SPI_PUSHR_16(w, CTARn, PCS) \
+	(((w)&0xffff) | SPI_PUSHR_CTAS(CTARn) | SPI_PUSHR_PCS(0x1f & PCS))
+
+
 #define SPI_WAIT(SPIx) \
 	while ((SPIx->SR & SPI_SR_TXCTR) != 0); \
 	while (!(SPIx->SR & SPI_SR_TCF)); \
@@ -85,12 +90,15 @@ public:
 
 	volatile int dataPointer;
 	volatile int packetCT;
+	volatile uint32_t wordCT; //words moved since boot, never reset by the sketch
 	volatile int data16;
 
 	unsigned long timeStamp1;
 	unsigned long timeStamp2;
 	uint8_t ctar;
 	KINETISK_SPI_t * SPIx;
+	volatile bool dmaActive;
+	DMAChannel * dmaTx;
 
 
 	T3SPI(KINETISK_SPI_t * spi_used);
@@ -102,9 +110,17 @@ public:
 	void enableCS(uint8_t cs, bool activeState);
 	void tx8(volatile uint8_t *dataOUT,  int length, bool CTARn, uint8_t PCS);
 	void tx16(volatile uint16_t *dataOUT, int length, bool CTARn, uint8_t PCS);
+	void tx16_burst(volatile uint16_t *dataOUT, int length, bool CTARn, uint8_t PCS, int frameLength = 0);
 	void txrx8(volatile uint8_t *dataOUT, volatile uint8_t *dataIN, int length, bool CTARn, uint8_t PCS);
 	void txrx16(volatile uint16_t *dataOUT, volatile uint16_t *dataIN, int length, bool CTARn, uint8_t PCS);
 
+	//DMA transmit (SPI0 only). Returns immediately, callback runs from interrupt once the last word is on the wire
+	void tx16_dma(volatile uint16_t *dataOUT, int length, bool CTARn, uint8_t PCS, void (*callback)(void), int frameLength = 0);
+	void txPUSHR_dma(volatile uint32_t *pushr, int length, void (*callback)(void));
+	void waitDMA();
+	void dmaFinish();
+	void abortDMA();
+
 	//Functions for SLAVE MODE
 	void begin_SLAVE();
 	void begin_SLAVE(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs);
@@ -129,8 +145,11 @@ private:
 	void enablePins(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs, bool activeState);
 	void enablePins_SLAVE(uint8_t sck, uint8_t mosi, uint8_t miso, uint8_t cs);
 void setCS_ActiveLOW(uint32_t);
+	void (*dmaCallback)(void);
 };
 
+void dma_tx_isr(void);
+
 
 //extern T3SPI_MASTER T3SPI;
 #define SPIClass T3SPI //_MASTER
@@ -1,3 +1,5 @@
+#include <EEPROM.h>
+
 
 /******************************************************/
 /*************** STATE FOR DATA TRANSFER **************/
@@ -51,8 +53,9 @@ int block_transitions[maxBlocks];
 int block_base[maxBlocks];
 bool lendian;
 
-float coefStore[256] = {
-
+// rows the firmware plays before the first upload
+const int defaultCoefLength = 256;
+const float defaultCoefStore[defaultCoefLength] = {
 1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, //1.1
 0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0, //1.2
 0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0, //1.3
@@ -71,8 +74,98 @@ float coefStore[256] = {
 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1, //2.8
 };
 
+/* The shim table is kept as DAC codes, channels codes per row, already scaled
+   with gain/zeroPoint so playback does no float math. Tables take what the
+   header asks for out of codePool, see STREAMING UPLOAD for the second bank.
+   A deduplicated table stores each distinct row once and plays them through
+   an index, one entry per table row, kept in the pool right after the codes. */
+const int codePoolLength = 8192;
+uint16_t codePool[codePoolLength];
+uint16_t * dacStore = codePool;
+int dacStoreLength = 0; // codes in the active table, 0 = no table
+const uint8_t * tableIndex = NULL; // table row -> stored row, NULL = rows stored in order
+uint8_t tableIndexSize = 1; // bytes per index entry, 1 or 2
+int tableRows = 0; // entries in tableIndex
+// calibration the table codes were encoded with, see recode_dac_table()
+float tableGain[MAX_B][NUM_C];
+float tableZero[MAX_B][NUM_C];
+uint16_t calibrationEpoch = 0; // bumped whenever the codes are recoded for a new calibration
+
+// the second bank, filled by the streaming upload
+typedef struct table_bank {
+  int channels;
+  int blocks;
+  int lengths[maxBlocks];
+  int reps[maxBlocks];
+  uint16_t * codes;
+  int length;
+  uint8_t * index; // NULL for a table stored in order
+  uint8_t indexSize;
+  int rows;
+} table_bank;
+
+table_bank stagedBank;
+bool uploadActive = false;
+volatile bool stagedReady = false; // complete bank waiting for table_swap()
+volatile bool swapPending = false; // swap at the next trigger
+
+/******************************************************/
+/*********************** TOPOLOGY *********************/
+/******************************************************/
+
+/* Which channels of which boards make up the table columns, in column order.
+   -1 ends a board's list. The default is one board with all eight channels;
+   the host replaces it with CMD_SET_TOPOLOGY */
+int8_t channels_used[MAX_B][NUM_C]  =
+{
+  {0, 1, 2, 3, 4, 5, 6, 7}
+};
+int numColumns = 0;
+
+/* Precomputed write plan: consecutive columns on the same board are one
+   entry, so playback selects each board once per row */
+typedef struct board_plan {
+  int8_t board;
+  int first;        // first table column of the group
+  int count;
+  LTC2656_ADDRESS dac[NUM_C];
+  uint8_t channel[NUM_C];
+} board_plan;
+
+board_plan writePlan[MAX_B * NUM_C];
+int writePlanLength = 0;
+
+void build_topology() {
+  for (int j = 0; j < MAX_B * NUM_C; j++) {
+    channel_order[j] = -1;
+    board_order[j] = -1;
+  }
+  int i = 0;
+  writePlanLength = 0;
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      int8_t ch = channels_used[b][c];
+      if (ch == -1) {
+        break;
+      }
+      channel_order[i] = ch;
+      board_order[i] = b;
+      if (writePlanLength == 0 || writePlan[writePlanLength - 1].board != b) {
+        board_plan * bp = &writePlan[writePlanLength++];
+        bp->board = b;
+        bp->first = i;
+        bp->count = 0;
+      }
+      board_plan * bp = &writePlan[writePlanLength - 1];
+      bp->dac[bp->count] = channelMap[ch];
+      bp->channel[bp->count] = ch;
+      bp->count++;
+      i = i + 1;
+    }
+  }
+  numColumns = i;
+}
 
-float coefStoreAsMat(int chanIdx, int blockIdx, int repIdx);
 /******************************************************/
 /*********************** UTILITY CALCULATIONS *********/
 /******************************************************/
@@ -83,7 +176,13 @@ uint16_t computeDacVal_V(float voltage, int b, int c) {
 }
 
 uint16_t computeDacVal_I(float current, int b, int c) {
-  return uint16_t((65535.0 * (current / gain[b][c] + 2.5 - zeroPoint[b][c]) / 5.0));
+  float code = 65535.0 * (current / gain[b][c] + 2.5 - zeroPoint[b][c]) / 5.0;
+  return uint16_t(constrain(code + 0.5, 0.0, 65535.0)); // round to nearest, saturate instead of wrapping
+}
+
+// inverse of computeDacVal_I for a given calibration
+float computeCurrent(uint16_t dacVal, float g, float z) {
+  return (float(dacVal) * 5.0 / 65535.0 - 2.5 + z) * g;
 }
 
 float computeOutV(uint16_t dacVal) {
@@ -98,15 +197,28 @@ float computeOutI(uint16_t dacVal) {
 /******************************************************/
 /*********************** UTILITY *********************/
 /******************************************************/
+// call whenever gain or zeroPoint change
+void zero_codes_update() {
+  for (int b = 0; b < MAX_B; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      zeroCode[b][c] = computeDacVal_I(0, b, c);
+    }
+  }
+}
+
+// staged writes of the precomputed zero codes, one latch per board
 void zero_all() {  /// JPS changed from float
-  for (int b = 0; b < NUM_B; b++) {
+  for (int b = 0; b < numBoards; b++) {
     selectBoard(b);
     for (int c = 0; c < NUM_C; c++) {
-      LTC2656Write(WRITE_AND_UPDATE, channelMap[c], computeDacVal_I(0, b, c));
+      LTC2656Stage(channelMap[c], zeroCode[b][c]);
     }
+    LTC2656Latch();
   }
 }
 
+const uint8_t calibrationSamples = 16; // oversampling for each zero point iteration
+
 float measure_gain(uint8_t b, uint8_t c) {
   //jump to 2.0 first so output returns nutral;
 
@@ -140,7 +252,7 @@ bool calibrate_channel(uint8_t b, uint8_t c) {
   //  Serial.print("gain: ");
   //  Serial.println(gain[b][c]);
   for (int i = 0; i < 10; i++) {
-    float output_offset_I = computeOutI(LTC1863ReadSlow(c));
+    float output_offset_I = computeOutI(LTC1863ReadSlow(c, calibrationSamples));
     //    Serial.print("iteration: ");
     //    Serial.println(i);
     //    Serial.println(output_offset_I,5);
@@ -161,17 +273,206 @@ bool calibrate_channel(uint8_t b, uint8_t c) {
   return false;
 }
 
-void calibrate_all() { // JPS changed from bool
-  for (int b = 0; b < NUM_B; b++) {
+/* Calibrates every channel of every board together: each step is written to
+   all channels before a single settle, and each board is read back with one
+   interleaved sweep, so the whole array takes about as long as one channel */
+const uint8_t allChannels[NUM_C] = {0, 1, 2, 3, 4, 5, 6, 7};
+
+// voltage (or, with voltage < 0, the calibrated zero) on every channel of every board
+void stage_all_boards(float voltage) {
+  for (int b = 0; b < numBoards; b++) {
+    selectBoard(b);
     for (int c = 0; c < NUM_C; c++) {
-      calibrate_channel(b, c);
+      uint16_t code = (voltage < 0) ? computeDacVal_I(0, b, c) : computeDacVal_V(voltage, 0, 0);
+      LTC2656Stage(channelMap[c], code);
     }
-    delay(500);
+    LTC2656Latch();
   }
 }
 
+// per board success, a timed out board reads as all zeros
+void read_all_boards(uint16_t out[][NUM_C], bool * ok, uint8_t count) {
+  for (int b = 0; b < numBoards; b++) {
+    selectBoard(b);
+    ok[b] = LTC1863ReadOversampled(allChannels, NUM_C, count, out[b]);
+    if (!ok[b]) {
+      memset(out[b], 0, sizeof(out[b]));
+    }
+  }
+}
+
+int calibrate_all() { // JPS changed from bool, returns the channels calibrated
+  uint16_t lo[MAX_B][NUM_C];
+  uint16_t hi[MAX_B][NUM_C];
+  bool ok[MAX_B];
+  bool okLo[MAX_B];
+  bool pending[MAX_B][NUM_C];
+
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      zeroPoint[b][c] = 0;
+    }
+  }
+  // gain from a 2.0V -> 2.5V step, same as measure_gain()
+  stage_all_boards(2.0);
+  delayMicroseconds(1000);
+  read_all_boards(lo, okLo, 50);
+  stage_all_boards(2.5);
+  delayMicroseconds(1000);
+  read_all_boards(hi, ok, 50);
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      gain[b][c] = (computeOutI(hi[b][c]) - computeOutI(lo[b][c])) / (0.5);
+      pending[b][c] = okLo[b] && ok[b] && abs(gain[b][c] + 1.62) <= 0.5;
+      calibrationStatus[b][c] = false;
+    }
+  }
+
+  // zero points, every channel still off by more than 1mA steps at once
+  for (int i = 0; i < 10; i++) {
+    read_all_boards(lo, ok, calibrationSamples);
+    bool stepped = false;
+    for (int b = 0; b < numBoards; b++) {
+      for (int c = 0; c < NUM_C; c++) {
+        if (!pending[b][c]) {
+          continue;
+        }
+        float output_offset_I = computeOutI(lo[b][c]);
+        if (!ok[b]) {
+          pending[b][c] = false;
+        } else if (abs(output_offset_I) <= 0.001) {
+          calibrationStatus[b][c] = true;
+          pending[b][c] = false;
+        } else {
+          zeroPoint[b][c] = zeroPoint[b][c] + (output_offset_I / gain[b][c]);
+          stepped = true;
+        }
+      }
+    }
+    if (!stepped) {
+      break;
+    }
+    stage_all_boards(-1);
+    delay(25);   // amplifier rise time, see calibrate_channel()
+  }
+
+  int calibrated = 0;
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      if (calibrationStatus[b][c]) {
+        calibrated++;
+      } else {
+        zeroPoint[b][c] = 0;
+      }
+    }
+  }
+  stage_all_boards(-1);
+  return calibrated;
+}
+
+/******************************************************/
+/*********************** CALIBRATION STORE ************/
+/******************************************************/
+
+/* Calibration and the topology it was measured on, kept in EEPROM so a warm
+   start only needs calibration_drift_check(). The record is rejected when the
+   magic, version or crc do not match and the defaults are kept */
+#define CAL_ADDRESS 0
+#define CAL_MAGIC   0x5348
+#define CAL_VERSION 1
+
+typedef struct cal_record {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t numBoards;
+  uint8_t boardMap[MAX_B];
+  int8_t channels_used[MAX_B][NUM_C];
+  float zeroPoint[MAX_B][NUM_C];
+  float gain[MAX_B][NUM_C];
+  uint8_t calibrationStatus[MAX_B][NUM_C];
+  uint16_t crc;
+} cal_record;
+
+const float driftTolerance = 0.003; // A at zero current before a channel is recalibrated
+bool calibrationLoaded = false;
+
+uint16_t cal_record_crc(const cal_record * r) {
+  return crc16((const uint8_t *)r, offsetof(cal_record, crc));
+}
+
+void calibration_save() {
+  cal_record r;
+  memset(&r, 0, sizeof(r));
+  r.magic = CAL_MAGIC;
+  r.version = CAL_VERSION;
+  r.numBoards = numBoards;
+  for (int b = 0; b < MAX_B; b++) {
+    r.boardMap[b] = boardMap[b];
+    for (int c = 0; c < NUM_C; c++) {
+      r.channels_used[b][c] = channels_used[b][c];
+      r.zeroPoint[b][c] = zeroPoint[b][c];
+      r.gain[b][c] = gain[b][c];
+      r.calibrationStatus[b][c] = calibrationStatus[b][c];
+    }
+  }
+  r.crc = cal_record_crc(&r);
+  EEPROM.put(CAL_ADDRESS, r); // only rewrites the bytes that changed
+  calibrationLoaded = true;
+}
+
+bool calibration_load() {
+  cal_record r;
+  EEPROM.get(CAL_ADDRESS, r);
+  if (r.magic != CAL_MAGIC || r.version != CAL_VERSION || r.crc != cal_record_crc(&r)
+      || r.numBoards == 0 || r.numBoards > MAX_B) {
+    return false;
+  }
+  numBoards = r.numBoards;
+  for (int b = 0; b < MAX_B; b++) {
+    boardMap[b] = r.boardMap[b];
+    for (int c = 0; c < NUM_C; c++) {
+      channels_used[b][c] = r.channels_used[b][c];
+      zeroPoint[b][c] = r.zeroPoint[b][c];
+      gain[b][c] = r.gain[b][c];
+      calibrationStatus[b][c] = r.calibrationStatus[b][c];
+    }
+  }
+  build_topology();
+  calibrationLoaded = true;
+  return true;
+}
+
+/* Reads every channel at zero current in one sweep per board and only
+   recalibrates the channels that drifted out of tolerance. Without a stored
+   record everything is calibrated. Returns the channels recalibrated */
+int calibration_drift_check() {
+  if (!calibrationLoaded) {
+    calibrate_all();
+    calibration_save();
+    return numBoards * NUM_C;
+  }
+  uint16_t out[MAX_B][NUM_C];
+  bool ok[MAX_B];
+  stage_all_boards(-1);
+  delay(25);
+  read_all_boards(out, ok, calibrationSamples);
+  int recalibrated = 0;
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      if (!ok[b] || !calibrationStatus[b][c] || abs(computeOutI(out[b][c])) > driftTolerance) {
+        calibrate_channel(b, c);
+        recalibrated++;
+      }
+    }
+  }
+  if (recalibrated > 0) {
+    calibration_save();
+  }
+  return recalibrated;
+}
+
 void print_all_boards() {
-  for (int b = 0; b < NUM_B; b++) {
+  for (int b = 0; b < numBoards; b++) {
     selectBoard(b);
     Serial.println("---------------");
     Serial.print("B: ");
@@ -193,56 +494,671 @@ void print_all_boards() {
   }
 }
 
-void update_outputs(int blkIdx, int repIdx) {
-  int8_t b = 0;
-  selectBoard(b);
-  //Serial.println('-------------------------');  //JPS hacked june 2019
-  Serial.println("-------------------------");
-  for (int i = 0; i < NUM_C * NUM_B; i++) {
-    int c = channel_order[i];
-    if (c == -1 || c == -1) {
-      break;
+int table_rows(const int * len, int blk) {
+  int rows = 0;
+  for (int i = 0; i < blk; i++) {
+    rows += len[i];
+  }
+  return rows;
+}
+
+// DAC code for the current of table column col
+uint16_t encode_current(float current, int col) {
+  if (col >= numColumns) {
+    return 32768;
+  }
+  return computeDacVal_I(current, board_order[col], channel_order[col]);
+}
+
+void snapshot_table_calibration() {
+  for (int b = 0; b < numBoards; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      tableGain[b][c] = gain[b][c];
+      tableZero[b][c] = zeroPoint[b][c];
     }
-    if (b != board_order[i]) {
-      b = board_order[i];
-      selectBoard(b);
+  }
+}
+
+void load_default_table() {
+  int total = channels * table_rows(lengths, blocks);
+  dacStoreLength = min(total, codePoolLength);
+  tableIndex = NULL;
+  for (int idx = 0; idx < dacStoreLength; idx++) {
+    float current = (idx < defaultCoefLength) ? defaultCoefStore[idx] : 0;
+    dacStore[idx] = encode_current(current, idx % channels);
+  }
+  snapshot_table_calibration();
+}
+
+/* Re-encode the tables after a calibration. computeDacVal_I rounds to
+   nearest, so a code recoded with unchanged calibration comes back as itself
+   and each pass is off by at most half an LSB either way, with no drift */
+void recode_codes(uint16_t * codes, int length, int ch) {
+  for (int idx = 0; idx < length; idx++) {
+    int col = idx % ch;
+    if (col >= numColumns) {
+      continue;
     }
+    int b = board_order[col];
+    int c = channel_order[col];
+    float current = computeCurrent(codes[idx], tableGain[b][c], tableZero[b][c]);
+    codes[idx] = computeDacVal_I(current, b, c);
+  }
+}
+
+/******************************************************/
+/*********************** WAVEFORM *********************/
+/******************************************************/
+
+/* Sub-TR ramps. A ramp is a list of breakpoints, each a duration in ticks and
+   a per-column code offset from the row the trigger just wrote. waveTimer
+   moves the offsets linearly towards the next breakpoint every waveTickUs and
+   writes the row through the DAC DMA path; the last breakpoint holds until
+   the next trigger. Rows of a block mapped to a ramp (blockRamp) start it
+   when they are written, every other row stays static. Offsets are 16.16
+   fixed point, so a tick is one add per column and a DMA chain */
+
+#define WAVE_MAX_RAMPS   4
+#define WAVE_MAX_POINTS  8
+#define WAVE_MAX_OFFSET  16383 // codes, keeps the 16.16 slopes in range
+#define WAVE_MIN_TICK_US 20    // 50 kHz
+
+typedef struct wave_ramp {
+  uint8_t points;   // 0 = not defined
+  uint8_t columns;  // table channels it was defined for
+  uint16_t ticks[WAVE_MAX_POINTS];
+  int16_t offset[WAVE_MAX_POINTS][MAX_B * NUM_C];
+} wave_ramp;
+
+wave_ramp waveRamps[WAVE_MAX_RAMPS];
+uint8_t blockRamp[maxBlocks];   // ramp id + 1 of each block, 0 = static rows
+unsigned waveTickUs = 0;        // 0 = waveforms off
 
-//    Serial.println(coefStoreAsMat(i, blkIdx, repIdx));
-    LTC2656Write(WRITE_AND_UPDATE, channelMap[c],
-                 computeDacVal_I(coefStoreAsMat(i, blkIdx, repIdx), b, c));
+IntervalTimer waveTimer;
+const uint8_t wavePriority = 160; // the trigger bottom half's, neither preempts the other
 
+volatile bool waveActive = false;
+const wave_ramp * waveRamp;
+const uint16_t * waveBase;      // codes of the row being offset
+uint8_t waveGroups;
+uint8_t wavePoint;              // breakpoint being approached
+uint16_t waveTick;
+int32_t waveOffset[MAX_B * NUM_C];
+int32_t waveSlope[MAX_B * NUM_C];
+
+void wave_stop() {
+  waveTimer.end();
+  waveActive = false;
+}
+
+// write plan groups that hold table columns
+int wave_groups() {
+  int g = 0;
+  while (g < writePlanLength && writePlan[g].first < channels) {
+    g++;
   }
+  return g;
 }
 
-void print_all() {
-  int8_t b = 0;
-  selectBoard(b);
-  Serial.println("-------------");
-  for (int i = 0; i < NUM_C * NUM_B; i++) {
+void wave_segment() {
+  int32_t ticks = waveRamp->ticks[wavePoint];
+  for (int i = 0; i < waveRamp->columns; i++) {
+    waveSlope[i] = (((int32_t)waveRamp->offset[wavePoint][i] << 16) - waveOffset[i]) / ticks;
+  }
+  waveTick = 0;
+}
 
-    int c = channel_order[i];
-    if (c == -1) {
-      break;
+// false while the previous tick is still on the wire
+bool wave_write() {
+  for (int p = 0; p < waveGroups; p++) {
+    const board_plan * bp = &writePlan[p];
+    int n = min(bp->count, channels - bp->first);
+    for (int k = 0; k < n; k++) {
+      int col = bp->first + k;
+      int32_t code = (int32_t)waveBase[col] + (waveOffset[col] >> 16);
+      dac_dma_code(p, k, uint16_t(constrain(code, 0, 65535)));
+    }
+  }
+  return dac_dma_start(waveGroups);
+}
+
+void wave_tick() {
+  if (!waveActive) {
+    return;
+  }
+  uint32_t t0 = stat_begin();
+  const wave_ramp * r = waveRamp;
+  if (wavePoint < r->points) {
+    for (int i = 0; i < r->columns; i++) {
+      waveOffset[i] += waveSlope[i];
+    }
+    if (++waveTick >= r->ticks[wavePoint]) {
+      // land exactly on the breakpoint, the slopes truncate
+      for (int i = 0; i < r->columns; i++) {
+        waveOffset[i] = (int32_t)r->offset[wavePoint][i] << 16;
+      }
+      wavePoint++;
+      if (wavePoint < r->points) {
+        wave_segment();
+      }
+    }
+  }
+  if (!wave_write()) {
+    statWaveSkips++; // the ramp keeps its time, this step is just not written
+  } else if (wavePoint >= r->points) {
+    wave_stop();
+  }
+  stat_end(STAT_WAVE_TICK, t0);
+}
+
+// right after the trigger wrote row of block blk: start its ramp, or stay static
+void wave_row(int blk, const uint16_t * row) {
+  wave_stop();
+  if (waveTickUs == 0 || row == NULL || blockRamp[blk] == 0) {
+    return;
+  }
+  const wave_ramp * r = &waveRamps[blockRamp[blk] - 1];
+  if (r->points == 0 || r->columns != channels) {
+    return;
+  }
+  waveRamp = r;
+  waveBase = row;
+  wavePoint = 0;
+  for (int i = 0; i < r->columns; i++) {
+    waveOffset[i] = 0;
+  }
+  waveGroups = wave_groups();
+  for (int p = 0; p < waveGroups; p++) {
+    const board_plan * bp = &writePlan[p];
+    dac_dma_build(p, bp->board, bp->dac, min(bp->count, channels - bp->first));
+  }
+  wave_segment();
+  waveActive = true;
+  waveTimer.begin(wave_tick, waveTickUs);
+  waveTimer.priority(wavePriority);
+}
+
+// [ramp id][points] then per point [u16 ticks][int16 offset x channels], 0 points clears
+frame_error wave_set_ramp(const uint8_t * p, uint16_t len, bool armed) {
+  if (armed) {
+    return ERR_SEQUENCE;
+  }
+  if (len < 2) {
+    return ERR_LENGTH;
+  }
+  uint8_t id = p[0];
+  uint8_t points = p[1];
+  if (id >= WAVE_MAX_RAMPS || points > WAVE_MAX_POINTS) {
+    return ERR_BAD_ARG;
+  }
+  int pointSize = 2 + 2 * channels;
+  if (len != 2 + points * pointSize) {
+    return ERR_LENGTH;
+  }
+  for (int k = 0; k < points; k++) {
+    const uint8_t * pt = p + 2 + k * pointSize;
+    uint16_t ticks;
+    memcpy(&ticks, pt, 2);
+    if (ticks == 0) {
+      return ERR_BAD_ARG;
+    }
+    for (int i = 0; i < channels; i++) {
+      int16_t off;
+      memcpy(&off, pt + 2 + 2 * i, 2);
+      if (abs(off) > WAVE_MAX_OFFSET) {
+        return ERR_BAD_ARG;
+      }
+    }
+  }
+  wave_stop();
+  wave_ramp * r = &waveRamps[id];
+  r->points = points;
+  r->columns = channels;
+  for (int k = 0; k < points; k++) {
+    const uint8_t * pt = p + 2 + k * pointSize;
+    memcpy(&r->ticks[k], pt, 2);
+    memcpy(r->offset[k], pt + 2, 2 * channels);
+  }
+  return ERR_NONE;
+}
+
+/* [u16 tick us, 0 = off][n blocks][ramp id + 1 x n, 0 = static]. The tick
+   has to leave room for a whole row on the wire */
+frame_error wave_set_map(const uint8_t * p, uint16_t len, bool armed) {
+  if (armed) {
+    return ERR_SEQUENCE;
+  }
+  if (len < 3 || len != 3 + p[2]) {
+    return ERR_LENGTH;
+  }
+  uint16_t tickUs;
+  memcpy(&tickUs, p, 2);
+  uint8_t n = p[2];
+  if (n > maxBlocks) {
+    return ERR_BAD_ARG;
+  }
+  if (tickUs != 0 && (tickUs < WAVE_MIN_TICK_US || tickUs < dac_dma_row_us(channels, wave_groups()))) {
+    return ERR_BAD_ARG;
+  }
+  for (int k = 0; k < n; k++) {
+    if (p[3 + k] > WAVE_MAX_RAMPS) {
+      return ERR_BAD_ARG;
     }
-    if (b != board_order[i]) {
-      b = board_order[i];
-      selectBoard(b);
-    }
-    uint16_t data = LTC1863ReadSlow(c);
-    Serial.print(i);
-    Serial.print("(");
-    Serial.print(b);
-    Serial.print(",");
-    Serial.print(c);
-    Serial.print(")\t");
-    Serial.print(computeOutI(data), 4);
-    Serial.print("\t");
-    Serial.print(gain[b][c]);
+  }
+  wave_stop();
+  waveTickUs = tickUs;
+  for (int k = 0; k < maxBlocks; k++) {
+    blockRamp[k] = (k < n) ? p[3 + k] : 0;
+  }
+  return ERR_NONE;
+}
+
+/******************************************************/
+/*********************** BACKGROUND *******************/
+/******************************************************/
+
+/* backgroundTimer runs the slow loops that share the ADC engine, regulation
+   and telemetry, below the trigger interrupt's priority so the trigger
+   always preempts it. It only runs while one of them is on */
+typedef enum background_user {BACKGROUND_REGULATION = 1, BACKGROUND_TELEMETRY = 2} background_user;
+
+IntervalTimer backgroundTimer;
+const unsigned backgroundPeriodUs = 500;
+const uint8_t backgroundPriority = 192; // pin interrupts default to 128
+uint8_t backgroundUsers = 0;
+
+void background_tick();
+
+void background_use(background_user user, bool on) {
+  uint8_t users = on ? (backgroundUsers | user) : (backgroundUsers & ~user);
+  if (users && !backgroundUsers) {
+    backgroundTimer.begin(background_tick, backgroundPeriodUs);
+    backgroundTimer.priority(backgroundPriority);
+  } else if (!users && backgroundUsers) {
+    backgroundTimer.end();
+  }
+  backgroundUsers = users;
+}
+
+/******************************************************/
+/*********************** REGULATION *******************/
+/******************************************************/
+
+/* Optional closed loop on top of the calibrated open loop. While the trigger
+   is armed backgroundTimer reads one write plan group per sweep through the
+   ADC engine and integrates the error between the current the last table row
+   asked for and the current read back into a per-channel code trim that
+   update_outputs_row() adds to the next row.
+
+   Each background tick either starts one sweep or folds in the result of one
+   (at most NUM_C channels). Reads wait regSettleUs after a row is written so
+   the amplifiers are not measured mid slew. */
+
+bool regRequested = false;  // host asked for regulation
+volatile bool regActive = false;
+float regKi = 0.2;          // fraction of the error corrected per read
+const float regDeadband = 0.0005; // A
+const float regMaxTrim = 1311;    // codes, 100mV of DAC output
+unsigned long regSettleUs = 200;
+volatile unsigned long regLastWriteUs = 0;
+
+uint16_t regCode[MAX_B][NUM_C];   // untrimmed codes of the last row played
+float regIntegral[MAX_B][NUM_C];
+volatile int16_t regTrim[MAX_B][NUM_C];
+int regGroup = 0;
+bool regReading = false;
+
+inline uint16_t regulated_code(int8_t b, uint8_t c, uint16_t code) {
+  if (!regActive) {
+    return code;
+  }
+  regCode[b][c] = code;
+  return uint16_t(constrain((int32_t)code + regTrim[b][c], 0, 65535));
+}
+
+void regulation_update(const board_plan * bp, const uint16_t * data) {
+  int8_t b = bp->board;
+  for (int k = 0; k < bp->count; k++) {
+    uint8_t c = bp->channel[k];
     if (!calibrationStatus[b][c]) {
-      Serial.println(" X");
-    } else {
-      Serial.println("");
+      continue;
+    }
+    float target = computeCurrent(regCode[b][c], gain[b][c], zeroPoint[b][c]);
+    float err = target - computeOutI(data[k]);
+    if (abs(err) < regDeadband) {
+      continue;
+    }
+    // dcode/dI = 65535 / (5 * gain), see computeDacVal_I
+    regIntegral[b][c] = constrain(regIntegral[b][c] + regKi * err * 65535.0 / (5.0 * gain[b][c]),
+                                  -regMaxTrim, regMaxTrim);
+    regTrim[b][c] = int16_t(regIntegral[b][c]);
+  }
+}
+
+void regulation_tick() {
+  if (!regActive || writePlanLength == 0) {
+    return;
+  }
+  if (regReading) {
+    adc_state st = adc_poll();
+    if (st == ADC_RUNNING) {
+      return;
+    }
+    if (st == ADC_DONE && regGroup < writePlanLength) {
+      regulation_update(&writePlan[regGroup], adcResults);
+    }
+    adcState = ADC_IDLE;
+    regReading = false;
+    regGroup = (regGroup + 1 < writePlanLength) ? regGroup + 1 : 0;
+    return;
+  }
+  // a playing ramp owns the DAC path and moves the target under the read
+  if (waveActive || micros() - regLastWriteUs < regSettleUs) {
+    return;
+  }
+  const board_plan * bp = &writePlan[regGroup];
+  // fails while the main loop owns the ADC, the next tick tries again
+  regReading = adc_start(bp->channel, bp->count, bp->board);
+}
+
+void regulation_reset() {
+  for (int b = 0; b < MAX_B; b++) {
+    for (int c = 0; c < NUM_C; c++) {
+      regIntegral[b][c] = 0;
+      regTrim[b][c] = 0;
+    }
+  }
+}
+
+// called when the trigger is armed and halted
+void regulation_run(bool on) {
+  if (on && regRequested && !regActive) {
+    regulation_reset();
+    regGroup = 0;
+    regReading = false;
+    regActive = true;
+    background_use(BACKGROUND_REGULATION, true);
+  } else if (!on && regActive) {
+    regActive = false;
+    background_use(BACKGROUND_REGULATION, false);
+    if (regReading) {
+      adc_wait(); // bounded by the sweep timeout
+      adcState = ADC_IDLE;
+      regReading = false;
+    }
+  }
+}
+
+// [enable][float32 ki]
+frame_error regulation_set(const uint8_t * p, uint16_t len, bool armed) {
+  if (len != 5) {
+    return ERR_LENGTH;
+  }
+  float ki = frame_get_float(p + 1);
+  if (p[0] > 1 || !(ki > 0 && ki <= 1)) {
+    return ERR_BAD_ARG;
+  }
+  regulation_run(false);
+  regKi = ki;
+  regRequested = p[0];
+  regulation_run(armed);
+  return ERR_NONE;
+}
+
+/******************************************************/
+/*********************** TELEMETRY ********************/
+/******************************************************/
+
+/* Background current monitoring. Every telemetryPeriodUs a round reads one
+   write plan group per sweep through the ADC engine, interleaved with the
+   regulation sweeps, until every column has a reading. Finished rounds go
+   through telemetryRing and loop() sends them as EVT_TELEMETRY frames.
+   Samples are raw LTC1863 codes, 0xFFFF where a sweep timed out; the host
+   converts (computeOutI) and decimates. Runs armed or not: the ADC engine
+   restores the board select and blocking reads wait for the engine */
+
+#define TELEMETRY_MIN_PERIOD_MS 2
+#define TELEMETRY_MISSING 0xFFFF
+
+typedef struct telemetry_record {
+  uint32_t us;      // micros() when the round started
+  uint16_t seq;     // gaps are rounds dropped on a full ring
+  uint8_t columns;
+  uint16_t adc[MAX_B * NUM_C];
+} telemetry_record;
+
+spsc_ring<telemetry_record, 8> telemetryRing;
+volatile bool telemetryActive = false;
+unsigned long telemetryPeriodUs = 0;
+telemetry_record telemetryRound;
+bool telemetryRoundOpen = false;
+uint16_t telemetrySeq = 0;
+int telemetryGroup = 0;
+bool telemetryReading = false;
+
+void telemetry_tick() {
+  if (!telemetryActive || writePlanLength == 0) {
+    return;
+  }
+  if (telemetryReading) {
+    adc_state st = adc_poll();
+    if (st == ADC_RUNNING) {
+      return;
+    }
+    const board_plan * bp = &writePlan[telemetryGroup];
+    for (int k = 0; k < bp->count; k++) {
+      telemetryRound.adc[bp->first + k] = (st == ADC_DONE) ? adcResults[k] : TELEMETRY_MISSING;
+    }
+    adcState = ADC_IDLE;
+    telemetryReading = false;
+    if (++telemetryGroup >= writePlanLength) {
+      telemetryRound.columns = numColumns;
+      telemetryRing.push(telemetryRound);
+      telemetryRoundOpen = false;
+      telemetryGroup = 0;
+    }
+    return;
+  }
+  if (!telemetryRoundOpen) {
+    unsigned long now = micros();
+    if (now - telemetryRound.us < telemetryPeriodUs) {
+      return;
+    }
+    telemetryRound.us = now;
+    telemetryRound.seq = telemetrySeq++;
+    telemetryRoundOpen = true;
+  }
+  const board_plan * bp = &writePlan[telemetryGroup];
+  // fails while regulation or the main loop owns the ADC, the next tick tries again
+  telemetryReading = adc_start(bp->channel, bp->count, bp->board);
+}
+
+void telemetry_run(bool on) {
+  if (on && !telemetryActive) {
+    telemetryGroup = 0;
+    telemetryReading = false;
+    telemetryRoundOpen = false;
+    telemetryRound.us = micros() - telemetryPeriodUs;
+    telemetryRing.clear();
+    telemetryActive = true;
+    background_use(BACKGROUND_TELEMETRY, true);
+  } else if (!on && telemetryActive) {
+    telemetryActive = false;
+    background_use(BACKGROUND_TELEMETRY, false);
+    if (telemetryReading) {
+      adc_wait();
+      adcState = ADC_IDLE;
+      telemetryReading = false;
+    }
+  }
+}
+
+// [u16 period ms, 0 = off]
+frame_error telemetry_set(const uint8_t * p, uint16_t len) {
+  if (len != 2) {
+    return ERR_LENGTH;
+  }
+  uint16_t periodMs;
+  memcpy(&periodMs, p, 2);
+  if (periodMs != 0 && periodMs < TELEMETRY_MIN_PERIOD_MS) {
+    return ERR_BAD_ARG;
+  }
+  telemetry_run(false);
+  telemetryPeriodUs = 1000UL * periodMs;
+  telemetry_run(periodMs != 0);
+  return ERR_NONE;
+}
+
+// [u32 us][u16 seq][n columns][u16 adc x n], one frame per round
+int telemetry_pack(uint8_t * out, const telemetry_record * r) {
+  memcpy(out, &r->us, 4);
+  memcpy(out + 4, &r->seq, 2);
+  out[6] = r->columns;
+  memcpy(out + 7, r->adc, 2 * r->columns);
+  return 7 + 2 * r->columns;
+}
+
+void background_tick() {
+  regulation_tick();
+  telemetry_tick();
+}
+
+/******************************************************/
+/*********************** PLAYBACK CURSOR **************/
+/******************************************************/
+
+/* Incremental (block, rep, row) position in the table. Advancing costs the
+   same whatever the number of blocks: no scan of block_transitions, no modulo */
+typedef struct playback_cursor {
+  int blk;
+  int rep;          // row within the block
+  long left;        // triggers left in this block
+  int rowStart;     // first table row of the block
+  int row;          // current table row
+} playback_cursor;
+
+volatile playback_cursor cursor;
+
+int block_start_row(int blk) {
+  return (blk >= 1) ? block_base[blk - 1] : 0;
+}
+
+void cursor_enter_block(int blk) {
+  cursor.blk = blk;
+  cursor.rep = 0;
+  cursor.left = (long)reps[blk] * lengths[blk];
+  cursor.rowStart = block_start_row(blk);
+  cursor.row = cursor.rowStart;
+}
+
+void cursor_reset() {
+  cursor_enter_block(0);
+}
+
+// returns true when the table wrapped around to its first row
+bool cursor_advance() {
+  cursor.left--;
+  cursor.rep++;
+  cursor.row++;
+  if (cursor.rep == lengths[cursor.blk]) {
+    cursor.rep = 0;
+    cursor.row = cursor.rowStart;
+  }
+  if (cursor.left > 0) {
+    return false;
+  }
+  // blocks with no repetitions are stepped over, at most once each
+  int blk = cursor.blk;
+  do {
+    blk++;
+    if (blk >= blocks) {
+      cursor_reset();
+      return true;
+    }
+  } while ((long)reps[blk] * lengths[blk] == 0);
+  cursor_enter_block(blk);
+  return false;
+}
+
+// codes of table row row, or NULL past the end of the table
+const uint16_t * table_row(int row) {
+  if (dacStoreLength == 0) {
+    return NULL;
+  }
+  if (tableIndex != NULL) {
+    if (row >= tableRows) {
+      return NULL;
+    }
+    row = (tableIndexSize == 1) ? tableIndex[row] : ((const uint16_t *)tableIndex)[row];
+  }
+  int firstCode = channels * row;
+  if (firstCode + channels > dacStoreLength) {
+    return NULL;
+  }
+  return dacStore + firstCode;
+}
+
+// no Serial in here, it runs from the trigger interrupt
+// main loop callers pass STAT_UPDATE_MAIN so the trigger's slot is only touched at interrupt level
+void update_outputs_row(const uint16_t * row, stat_id stat = STAT_UPDATE_OUTPUTS) {
+  uint32_t t0 = stat_begin();
+  if (row == NULL) {
+    selectBoard(0);
+    return;
+  }
+  for (int p = 0; p < writePlanLength; p++) {
+    const board_plan * bp = &writePlan[p];
+    if (bp->first >= channels) {
+      break;
+    }
+    int n = min(bp->count, channels - bp->first);
+    const uint16_t * codes = row + bp->first;
+    selectBoard(bp->board);
+    for (int k = 0; k < n; k++) {
+      LTC2656Stage(bp->dac[k], regulated_code(bp->board, bp->channel[k], codes[k]));
+    }
+    LTC2656Latch(); // all channels of the board switch together
+  }
+  regLastWriteUs = micros();
+  stat_end(stat, t0);
+}
+
+void update_outputs(int blkIdx, int repIdx) {
+  update_outputs_row(table_row(block_start_row(blkIdx) + repIdx));
+}
+
+void print_all() {
+  Serial.println("-------------");
+  // one pipelined sweep per board, in playback order
+  for (int p = 0; p < writePlanLength; p++) {
+    const board_plan * bp = &writePlan[p];
+    int8_t b = bp->board;
+    int start = bp->first;
+    const uint8_t * sweep = bp->channel;
+    int n = bp->count;
+    uint16_t data[NUM_C];
+    selectBoard(b);
+    bool ok = LTC1863ReadSweep(sweep, n, data);
+    for (int k = 0; k < n; k++) {
+      int c = sweep[k];
+      Serial.print(start + k);
+      Serial.print("(");
+      Serial.print(b);
+      Serial.print(",");
+      Serial.print(c);
+      Serial.print(")\t");
+      if (ok) {
+        Serial.print(computeOutI(data[k]), 4);
+      } else {
+        Serial.print("timeout");
+      }
+      Serial.print("\t");
+      Serial.print(gain[b][c]);
+      if (!calibrationStatus[b][c] || !ok) {
+        Serial.println(" X");
+      } else {
+        Serial.println("");
+      }
     }
   }
 }
@@ -252,21 +1168,27 @@ void print_all() {
 /************** READ CTRL STRING  *********************/
 /******************************************************/
 
+int ctrlChannels = 1; // the c field of the last ascii header
+
 void read_ctrl_string(char * ctrlBuffer) {
   char* c = strchr(ctrlBuffer, 'c');
   char* bar = strchr(c, '|');
   bar[0] = 0;
-  channels = atoi(c + 1);
+  // a header wider than the topology is kept for read_float_dump to reject
+  ctrlChannels = max(atoi(c + 1), 1);
+  if (ctrlChannels <= numColumns) {
+    channels = ctrlChannels;
+  }
 
   char* b = strchr(bar + 1, 'b');
   bar = strchr(b, '|');
   bar[0] = 0;
-  blocks = atoi(b + 1);
+  blocks = constrain(atoi(b + 1), 1, maxBlocks);
   Serial.print("blocks:");
   Serial.println(blocks);
 
   char* l = strchr(bar + 1, 'l');
-  char* nextl;
+  char* nextl = l;
   Serial.println("lengths:");
   for (int i = 0; i < blocks; i++) {
     nextl = strchr(l + 1, '|');
@@ -300,41 +1222,442 @@ void read_ctrl_string(char * ctrlBuffer) {
     block_base[i] = block_base[i - 1] + lengths[i];
     Serial.println(block_base[i]);
   }
+  cursor_reset();
 }
 
-void compute_transitions_base() {
-  Serial.println("transitions:");
+void compute_transitions_base(bool verbose = true) {
   block_transitions[0] = reps[0] * lengths[0];
-  Serial.println(block_transitions[0]);
   for (int i = 1; i < blocks; i++) {
     block_transitions[i] = block_transitions[i - 1] + reps[i] * lengths[i];
-    Serial.println(block_transitions[i]);
   }
-  Serial.println("base:");
   block_base[0] = lengths[0];
-  Serial.println(block_base[0]);
   for (int i = 1; i < blocks; i++) {
     block_base[i] = block_base[i - 1] + lengths[i];
+  }
+  if (!verbose) {
+    return;
+  }
+  Serial.println("transitions:");
+  for (int i = 0; i < blocks; i++) {
+    Serial.println(block_transitions[i]);
+  }
+  Serial.println("base:");
+  for (int i = 0; i < blocks; i++) {
     Serial.println(block_base[i]);
   }
 }
 
 /* BLOCKING !!!!
-   TIMEOUT DETERMIEND BY SERIAL TIMEOUT*/
+   TIMEOUT DETERMIEND BY SERIAL TIMEOUT
+   floats are encoded a row at a time as they arrive */
 bool read_float_dump() {
   int totalLength = 0;
   for (int i = 0; i < blocks; i++) {
-    totalLength += channels * lengths[i];
+    totalLength += ctrlChannels * lengths[i];
   }
   if (Serial.available()) {
+    bool tooWide = ctrlChannels > numColumns;
+    if (tooWide || totalLength > codePoolLength) {
+      // swallow the table so it is not parsed as commands
+      char dump[64];
+      zeroRun = 0;
+      for (int left = 4 * totalLength; left > 0; left -= sizeof(dump)) {
+        int n = Serial.readBytes(dump, min(left, (int)sizeof(dump)));
+        if (n == 0 || zero_run_scan((const uint8_t *)dump, n)) {
+          break;
+        }
+      }
+      dacStoreLength = 0;
+      tableIndex = NULL;
+      Serial.println(tooWide ? "too many channels" : "table too big");
+      return 1;
+    }
     Serial.println("starting");
-    Serial.readBytes((char*)coefStore, 4 * totalLength);
+    // the legacy upload writes over the whole pool from the bottom
+    uploadActive = false;
+    stagedReady = false;
+    dacStoreLength = 0;
+    dacStore = codePool;
+    tableIndex = NULL;
+    float row[MAX_B * NUM_C];
+    zeroRun = 0;
+    for (int idx = 0; idx < totalLength; idx += channels) {
+      int n = Serial.readBytes((char*)row, 4 * channels);
+      // a cut short table is dropped, loop() zeroes
+      if (zero_run_scan((const uint8_t *)row, n)) {
+        return 1;
+      }
+      for (int i = 0; i < channels; i++) {
+        dacStore[idx + i] = encode_current(row[i], i);
+      }
+    }
+    dacStoreLength = totalLength;
+    snapshot_table_calibration();
     Serial.println("done");
     return 1;
   }
   return 0;
 }
 
+/* CMD_GET_CALIBRATION reply for the table columns from first on:
+   [u16 epoch][u8 columns][u8 first][u8 count] then per column
+   [u8 board][u8 channel][u8 calibrated][f32 gain][f32 zeroPoint] */
+#define CAL_PAGE_COLUMNS 32
+
+int calibration_pack(uint8_t * out, uint8_t first) {
+  uint8_t count = (first < numColumns) ? min(numColumns - first, CAL_PAGE_COLUMNS) : 0;
+  memcpy(out, &calibrationEpoch, 2);
+  out[2] = numColumns;
+  out[3] = first;
+  out[4] = count;
+  uint8_t * p = out + 5;
+  for (int i = first; i < first + count; i++) {
+    int b = board_order[i];
+    int c = channel_order[i];
+    p[0] = b;
+    p[1] = c;
+    p[2] = calibrationStatus[b][c];
+    memcpy(p + 3, &gain[b][c], 4);
+    memcpy(p + 7, &zeroPoint[b][c], 4);
+    p += 11;
+  }
+  return p - out;
+}
+
+/******************************************************/
+/************** STREAMING UPLOAD  *********************/
+/******************************************************/
+
+/* Non-blocking alternative to MODE_HEADER/MODE_BODY over binary frames:
+   UPLOAD_BEGIN carries the header, UPLOAD_CHUNKs must arrive in order (each is
+   ACKed, a gap is NAKed with ERR_SEQUENCE so the host can go back to the last
+   ACK, a chunk already stored is ACKed again) and UPLOAD_END completes the
+   table. The host never repeats UPLOAD_BEGIN, UPLOAD_BULK or UPLOAD_END, a
+   lost reply to one of them starts the upload over.
+
+   Uploads go to a second bank while the active one keeps playing. The banks
+   share codePool from opposite ends; a table too big to sit next to the
+   active one is written over it instead and playback pauses until it is
+   committed. table_swap() makes the staged bank active; the sketch calls it
+   at a trigger boundary so a scan never plays half of each table.
+
+   UPLOAD_BEGIN may end in [u16 stored rows][u8 index size] for a table whose
+   rows repeat (the same slices in every block of a multiband or SMS
+   protocol): the stream is then the stored rows in the upload format followed
+   by one index entry per table row, 1 or 2 bytes little endian, and the bank
+   takes only what the distinct rows need. */
+
+#define UPLOAD_FLOAT32 0
+#define UPLOAD_CODES   1 // uint16 DAC codes compiled by the host, see CMD_GET_CALIBRATION
+
+int uploadNext;
+uint8_t uploadFormat = UPLOAD_FLOAT32;
+frame_error bulkError = ERR_NONE; // a failed UPLOAD_BULK stream, reported by UPLOAD_END
+
+// pool words of a table: its codes then its index
+int table_words(int length, int indexBytes) {
+  return length + (indexBytes + 1) / 2;
+}
+
+// free end of the pool, opposite the active table
+uint16_t * staging_region(int total) {
+  int active = 0;
+  if (dacStoreLength > 0) {
+    active = table_words(dacStoreLength, (tableIndex != NULL) ? tableIndexSize * tableRows : 0);
+  }
+  if (active + total > codePoolLength) {
+    dacStoreLength = 0;
+    tableIndex = NULL;
+    return codePool;
+  }
+  if (dacStore == codePool) {
+    return codePool + codePoolLength - total;
+  }
+  return codePool;
+}
+
+frame_error upload_begin(const uint8_t * p, uint16_t len) {
+  if (len < 3) {
+    return ERR_LENGTH;
+  }
+  uint8_t format = p[0];
+  int ch = p[1];
+  int blk = p[2];
+  if (format > UPLOAD_CODES || ch == 0 || ch > numColumns || blk == 0 || blk > maxBlocks) {
+    return ERR_BAD_ARG;
+  }
+  // compiled codes carry the calibration epoch they were compiled against
+  int headerLength = 3 + 6 * blk + ((format == UPLOAD_CODES) ? 2 : 0);
+  bool indexed = (len == headerLength + 3);
+  if (len != headerLength && !indexed) {
+    return ERR_LENGTH;
+  }
+  uint16_t stored = 0;
+  uint8_t indexSize = 0;
+  if (indexed) {
+    memcpy(&stored, p + headerLength, 2);
+    indexSize = p[headerLength + 2];
+    if (stored == 0 || (indexSize != 1 && indexSize != 2) || (indexSize == 1 && stored > 256)) {
+      return ERR_BAD_ARG;
+    }
+  }
+  if (format == UPLOAD_CODES) {
+    uint16_t epoch;
+    memcpy(&epoch, p + 3 + 6 * blk, 2);
+    if (epoch != calibrationEpoch) {
+      return ERR_BAD_ARG;
+    }
+  }
+  // the whole header is checked before a table staged for CMD_TABLE_COMMIT is given up
+  int rows = 0;
+  for (int i = 0; i < blk; i++) {
+    uint16_t l;
+    memcpy(&l, p + 3 + 2 * i, 2);
+    if (l == 0) {
+      return ERR_BAD_ARG;
+    }
+    rows += l;
+  }
+  int length = ch * (indexed ? stored : rows);
+  int words = table_words(length, indexSize * rows);
+  if (words > codePoolLength) {
+    return ERR_TOO_BIG;
+  }
+  stagedReady = false; // a new upload replaces anything still waiting
+  swapPending = false;
+  for (int i = 0; i < blk; i++) {
+    uint16_t l;
+    uint32_t r;
+    memcpy(&l, p + 3 + 2 * i, 2);
+    memcpy(&r, p + 3 + 2 * blk + 4 * i, 4);
+    stagedBank.lengths[i] = l;
+    stagedBank.reps[i] = r;
+  }
+  stagedBank.channels = ch;
+  stagedBank.blocks = blk;
+  stagedBank.length = length;
+  stagedBank.rows = rows;
+  stagedBank.indexSize = indexSize;
+  stagedBank.codes = staging_region(words);
+  stagedBank.index = indexed ? (uint8_t *)(stagedBank.codes + length) : NULL;
+  uploadNext = 0;
+  uploadFormat = format;
+  bulkError = ERR_NONE;
+  uploadActive = true;
+  return ERR_NONE;
+}
+
+// values in the upload stream: the codes, then the index entries
+int upload_items() {
+  return stagedBank.length + ((stagedBank.index != NULL) ? stagedBank.rows : 0);
+}
+
+int upload_value_size() {
+  return (uploadFormat == UPLOAD_CODES) ? 2 : 4;
+}
+
+int upload_item_size(int idx) {
+  return (idx < stagedBank.length) ? upload_value_size() : stagedBank.indexSize;
+}
+
+uint32_t upload_stream_bytes(int from) {
+  int values = max(stagedBank.length - from, 0);
+  int entries = upload_items() - from - values;
+  return (uint32_t)upload_value_size() * values + (uint32_t)stagedBank.indexSize * entries;
+}
+
+void upload_store(int idx, const uint8_t * p) {
+  if (idx >= stagedBank.length) {
+    memcpy(stagedBank.index + stagedBank.indexSize * (idx - stagedBank.length), p, stagedBank.indexSize);
+  } else if (uploadFormat == UPLOAD_CODES) {
+    memcpy(&stagedBank.codes[idx], p, 2);
+  } else {
+    stagedBank.codes[idx] = encode_current(frame_get_float(p), idx % stagedBank.channels);
+  }
+}
+
+frame_error upload_chunk(const uint8_t * p, uint16_t len) {
+  if (!uploadActive) {
+    return ERR_SEQUENCE;
+  }
+  if (len < 2) {
+    return ERR_LENGTH;
+  }
+  uint16_t offset;
+  memcpy(&offset, p, 2);
+  if (offset > uploadNext) {
+    return ERR_SEQUENCE;
+  }
+  // a chunk may run from the codes into the index, so sizes are taken per value
+  int n = 0;
+  int used = 2;
+  while (used < len) {
+    if (offset + n >= upload_items()) {
+      return ERR_TOO_BIG;
+    }
+    used += upload_item_size(offset + n);
+    n++;
+  }
+  if (used != len) {
+    return ERR_LENGTH;
+  }
+  // sent again after its ACK was lost, already stored
+  if (offset < uploadNext) {
+    return (offset + n <= uploadNext) ? ERR_NONE : ERR_SEQUENCE;
+  }
+  used = 2;
+  for (int k = 0; k < n; k++) {
+    upload_store(offset + k, p + used);
+    used += upload_item_size(offset + k);
+  }
+  uploadNext += n;
+  return ERR_NONE;
+}
+
+// every index entry has to name a stored row
+bool upload_index_valid() {
+  int stored = stagedBank.length / stagedBank.channels;
+  for (int r = 0; r < stagedBank.rows; r++) {
+    int row = (stagedBank.indexSize == 1) ? stagedBank.index[r] : ((const uint16_t *)stagedBank.index)[r];
+    if (row >= stored) {
+      return false;
+    }
+  }
+  return true;
+}
+
+frame_error upload_end() {
+  if (bulkError != ERR_NONE) {
+    frame_error err = bulkError;
+    bulkError = ERR_NONE;
+    return err;
+  }
+  if (!uploadActive || uploadNext != upload_items()) {
+    return ERR_SEQUENCE;
+  }
+  if (stagedBank.index != NULL && !upload_index_valid()) {
+    uploadActive = false;
+    return ERR_BAD_ARG;
+  }
+  uploadActive = false;
+  stagedReady = true;
+  return ERR_NONE;
+}
+
+/* Bulk upload: after UPLOAD_BEGIN, one UPLOAD_BULK frame announces the rest
+   of the table as a raw little endian stream of the upload format, stuffed
+   like a frame (ZERO_STUFF in protocol.h). Once the frame is ACKed
+   the host sends the stream, which is pulled out of the USB buffer in large
+   blocks and encoded straight into the staged bank; UPLOAD_END then reports
+   whether it all arrived intact. On Teensy the serial port is native USB, so
+   this runs at bulk transfer speed instead of a round trip per UPLOAD_CHUNK. */
+
+#define BULK_BLOCK 512
+#define BULK_TIMEOUT_MS 500
+
+uint32_t bulkRemaining; // bytes still to come
+uint16_t bulkCrc;
+uint16_t bulkCrcExpected;
+unsigned long bulkLast;
+uint8_t bulkBlock[BULK_BLOCK];
+int bulkCarry; // bytes of a split value at the start of bulkBlock
+
+// [u32 byte count][u16 crc16 of the stream], both before stuffing
+frame_error upload_bulk_begin(const uint8_t * p, uint16_t len) {
+  if (!uploadActive) {
+    return ERR_SEQUENCE;
+  }
+  if (len != 6) {
+    return ERR_LENGTH;
+  }
+  uint32_t bytes;
+  memcpy(&bytes, p, 4);
+  memcpy(&bulkCrcExpected, p + 4, 2);
+  if (bytes == 0 || bytes != upload_stream_bytes(uploadNext)) {
+    return ERR_BAD_ARG;
+  }
+  bulkRemaining = bytes;
+  zeroRun = 0;
+  bulkCrc = 0xFFFF;
+  bulkCarry = 0;
+  bulkError = ERR_NONE;
+  bulkLast = millis();
+  return ERR_NONE;
+}
+
+// consume whatever has arrived without blocking, true once the stream is in, stalled or cut short by a ZERO_RUN
+bool upload_bulk_poll() {
+  int avail;
+  while (bulkRemaining > 0 && (avail = Serial.available()) > 0) {
+    int n = min((uint32_t)min(avail, BULK_BLOCK - bulkCarry), bulkRemaining);
+    n = Serial.readBytes((char *)bulkBlock + bulkCarry, n);
+    n = zero_run_unstuff(bulkBlock + bulkCarry, n);
+    if (zeroRunSeen) {
+      bulkRemaining = 0;
+      bulkError = ERR_TIMEOUT;
+      uploadActive = false;
+      return true;
+    }
+    bulkCrc = crc16(bulkBlock + bulkCarry, n, bulkCrc);
+    bulkRemaining -= n;
+    int have = bulkCarry + n;
+    int used = 0;
+    while (uploadNext < upload_items() && have - used >= upload_item_size(uploadNext)) {
+      upload_store(uploadNext, bulkBlock + used);
+      used += upload_item_size(uploadNext);
+      uploadNext++;
+    }
+    bulkCarry = have - used;
+    memmove(bulkBlock, bulkBlock + used, bulkCarry);
+    bulkLast = millis();
+  }
+  if (bulkRemaining == 0) {
+    bulkError = (bulkCrc == bulkCrcExpected) ? ERR_NONE : ERR_CRC;
+  } else if (millis() - bulkLast > BULK_TIMEOUT_MS) {
+    bulkError = ERR_TIMEOUT;
+  } else {
+    return false;
+  }
+  if (bulkError != ERR_NONE) {
+    uploadActive = false; // the host starts over with UPLOAD_BEGIN
+  }
+  return true;
+}
+
+// make the staged bank active; call with interrupts off or from the trigger
+void table_swap() {
+  if (!stagedReady) {
+    return;
+  }
+  dacStore = stagedBank.codes;
+  dacStoreLength = stagedBank.length;
+  tableIndex = stagedBank.index;
+  tableIndexSize = stagedBank.indexSize;
+  tableRows = stagedBank.rows;
+  channels = stagedBank.channels;
+  blocks = stagedBank.blocks;
+  for (int i = 0; i < blocks; i++) {
+    lengths[i] = stagedBank.lengths[i];
+    reps[i] = stagedBank.reps[i];
+  }
+  compute_transitions_base(false);
+  cursor_reset();
+  stagedReady = false;
+  swapPending = false;
+}
+
+// both banks were encoded with tableGain/tableZero
+void recode_dac_table() {
+  recode_codes(dacStore, dacStoreLength, channels);
+  if (stagedReady || uploadActive) {
+    recode_codes(stagedBank.codes, min(uploadActive ? uploadNext : stagedBank.length, stagedBank.length), stagedBank.channels);
+  }
+  snapshot_table_calibration();
+  zero_codes_update();
+  calibrationEpoch++;
+}
+
+// random access equivalents of the cursor, for seeking to a trigger count
 int computeBlockIdx(int iter) {
   int blkIdx = 0;
   for (int i = 0; i < blocks; i++) {
@@ -355,12 +1678,3 @@ int computeRepIdx(int iter, int blkIdx) {
   }
   return (iter - base) % lengths[blkIdx];
 }
-
-float coefStoreAsMat(int chanIdx, int blkIdx, int repIdx) {
-  int base = 0;
-  if (blkIdx >= 1) {
-    base = block_base[blkIdx - 1];
-  }
-  int idx = channels * (base + repIdx) + chanIdx;
-  return (coefStore[idx]);
-}
@@ -6,7 +6,7 @@ Includes both ui instantiation, as well as the logic for populating UI with data
 import pickle
 import sys
 
-from PyQt6.QtCore import Qt
+from PyQt6.QtCore import Qt, QTimer
 from PyQt6.QtGui import QBrush, QColor, QDoubleValidator, QFontMetrics, QImage, QIntValidator, QPainter, QPen, QPixmap
 from PyQt6.QtWidgets import (
     QApplication,
@@ -630,6 +630,35 @@ class Gui(QMainWindow):
         self.basisSliceIndexPack = addLabeledSliderAndEntry(leftLayout, "Slice Index (Int): ", self.updateBasisView)
         disableWidgetsInList(self.basisSliceIndexPack)
 
+        # RIGHT
+        rightLayout = QVBoxLayout()
+        hlayout.addLayout(rightLayout)
+        self.setupCurrentMonitor(rightLayout)
+
+    def setupCurrentMonitor(self, layout: QBoxLayout):
+        """live plot of the shim currents streamed by the arduino's background monitor"""
+        layout.addWidget(QLabel("SHIM Current Monitor"))
+        self.currentPlot = CurrentPlot(self)
+        layout.addWidget(self.currentPlot)
+        buttonLayout = QHBoxLayout()
+        layout.addLayout(buttonLayout)
+        self.startMonitorButton = addButtonConnectedToFunction(
+            buttonLayout, "Start Monitor", lambda: self.shimTool.shimInstance.shimSetTelemetry(20)
+        )
+        self.stopMonitorButton = addButtonConnectedToFunction(
+            buttonLayout, "Stop Monitor", lambda: self.shimTool.shimInstance.shimSetTelemetry(0)
+        )
+        # redraws from the client's rolling window, the serial thread never touches the gui
+        self.currentPlotTimer = QTimer(self)
+        self.currentPlotTimer.timeout.connect(self.updateCurrentPlot)
+        self.currentPlotTimer.start(100)
+
+    def updateCurrentPlot(self):
+        if not self.currentPlot.isVisible():
+            return
+        times, currents = self.shimTool.shimInstance.telemetry.snapshot(points=self.currentPlot.width())
+        self.currentPlot.setData(times, currents)
+
     # ---------- Slider Get Functions ----------- #
     def getROISliceIndex(self):
         return self.roiSliceIndexPack[1].value()
@@ -7,8 +7,8 @@ import time
 from functools import partial
 
 import numpy as np
-from PyQt6.QtCore import QObject, Qt, QThread, pyqtSignal
-from PyQt6.QtGui import QImage, QIntValidator, QValidator
+from PyQt6.QtCore import QObject, QPointF, Qt, QThread, pyqtSignal
+from PyQt6.QtGui import QColor, QImage, QIntValidator, QPainter, QPen, QPolygonF, QValidator
 from PyQt6.QtWidgets import (
     QBoxLayout,
     QCheckBox,
@@ -21,6 +21,7 @@ from PyQt6.QtWidgets import (
     QPushButton,
     QSizePolicy,
     QSlider,
+    QWidget,
 )
 
 
@@ -80,6 +81,42 @@ class ImageViewer(QGraphicsView):
                 self.label.clear()
 
 
+class CurrentPlot(QWidget):
+    """Minimal strip chart of the shim channel currents, drawn straight with QPainter"""
+
+    def __init__(self, parent=None, span=2.5):
+        super(CurrentPlot, self).__init__(parent)
+        self.span = span  # +- amps shown
+        self.times = np.empty(0)
+        self.currents = np.empty((0, 0))
+        self.setMinimumSize(400, 200)
+
+    def setData(self, times, currents):
+        self.times = times
+        self.currents = currents
+        self.update()
+
+    def paintEvent(self, event):
+        painter = QPainter(self)
+        painter.fillRect(self.rect(), QColor("white"))
+        w, h = self.width(), self.height()
+        painter.setPen(QPen(QColor("lightgray")))
+        painter.drawLine(0, h // 2, w, h // 2)
+        if len(self.times) < 2:
+            painter.drawText(10, 20, "no telemetry")
+            return
+        t0, t1 = self.times[0], self.times[-1]
+        xs = (self.times - t0) / max(t1 - t0, 1e-9) * (w - 1)
+        for col in range(self.currents.shape[1]):
+            ys = (0.5 - self.currents[:, col] / (2 * self.span)) * (h - 1)
+            painter.setPen(QPen(QColor.fromHsv(int(360 * col / self.currents.shape[1]) % 360, 200, 200)))
+            points = [QPointF(x, y) for x, y in zip(xs, ys) if np.isfinite(y)]
+            if len(points) > 1:
+                painter.drawPolyline(QPolygonF(points))
+        painter.setPen(QPen(QColor("black")))
+        painter.drawText(10, 20, f"+-{self.span} A, last {t1 - t0:.1f} s")
+
+
 def createMessageBox(title, text, informativeText):
     msg = QMessageBox()
     msg.setIcon(QMessageBox.Icon.Warning)
@@ -0,0 +1,113 @@
+"""Compile shim current solutions into the DAC code tables the arduino plays.
+
+The firmware turns currents into LTC2656 codes with computeDacVal_I (util.h):
+    code = 65535 * (current / gain + 2.5 - zeroPoint) / 5
+rounded to nearest and saturated to 0..65535. Doing that here once per upload,
+with the calibration read back from the device, leaves the trigger with nothing
+but the SPI writes and lets us reject saturating solutions before the scan starts.
+"""
+
+import struct
+from typing import List, Tuple
+
+import numpy as np
+
+DAC_FULL_SCALE = 65535
+WAVE_MAX_OFFSET = 16383  # see WAVEFORM in util.h
+
+
+class Calibration:
+    """Per table column calibration, in the board_order/channel_order of the device."""
+
+    def __init__(self, epoch: int, columns: List[Tuple[int, int]], gain, zeroPoint, calibrated):
+        self.epoch = epoch
+        self.columns = columns
+        self.gain = np.asarray(gain, dtype=np.float32)
+        self.zeroPoint = np.asarray(zeroPoint, dtype=np.float32)
+        self.calibrated = np.asarray(calibrated, dtype=bool)
+
+    def __len__(self):
+        return len(self.columns)
+
+
+def unpackCalibrationPage(payload):
+    """decode one CMD_GET_CALIBRATION reply (see calibration_pack in util.h)"""
+    epoch, total, first, count = struct.unpack_from("<HBBB", payload)
+    entries = []
+    for i in range(count):
+        board, channel, calibrated, gain, zeroPoint = struct.unpack_from("<BBBff", payload, 5 + 11 * i)
+        entries.append((board, channel, bool(calibrated), gain, zeroPoint))
+    return epoch, total, first, entries
+
+
+def joinCalibrationPages(pages):
+    """build a Calibration from the decoded pages of one epoch"""
+    epochs = {epoch for epoch, _, _, _ in pages}
+    if len(epochs) != 1:
+        raise ShimCodesError("calibration changed while it was being read")
+    entries = [e for _, _, _, page in sorted(pages, key=lambda p: p[2]) for e in page]
+    return Calibration(
+        epochs.pop(),
+        [(b, c) for b, c, _, _, _ in entries],
+        [g for _, _, _, g, _ in entries],
+        [z for _, _, _, _, z in entries],
+        [ok for _, _, ok, _, _ in entries],
+    )
+
+
+def compileCodes(currents, calibration: Calibration, allowSaturation=False):
+    """
+    currents: (rows x channels) solution matrix in A, one row per slice/trigger, columns in table order
+    returns the uint16 code table with the same shape; raises ShimCodesError if any value saturates
+    """
+    currents = np.atleast_2d(np.asarray(currents, dtype=np.float32))
+    channels = currents.shape[1]
+    if channels > len(calibration):
+        raise ShimCodesError(f"table has {channels} channels, the device has {len(calibration)}")
+    gain = calibration.gain[:channels]
+    zeroPoint = calibration.zeroPoint[:channels]
+    if not calibration.calibrated[:channels].all():
+        missing = [calibration.columns[i] for i in np.flatnonzero(~calibration.calibrated[:channels])]
+        print(f"WARNING SHIM CODES: uncalibrated (board, channel) {missing}")
+
+    # computeDacVal_I step by step in float32: Teensy builds with -fsingle-precision-constant,
+    # so its literals are floats too and every operation rounds to single precision
+    gain = gain.astype(np.float32)
+    zeroPoint = zeroPoint.astype(np.float32)
+    raw = np.float32(DAC_FULL_SCALE) * (currents / gain + np.float32(2.5) - zeroPoint) / np.float32(5.0)
+    saturated = (raw < 0) | (raw > DAC_FULL_SCALE)
+    if saturated.any() and not allowSaturation:
+        rows, cols = np.nonzero(saturated)
+        raise ShimCodesError(
+            f"{len(rows)} values saturate the DAC, first at row {rows[0]} column {cols[0]} "
+            f"({currents[rows[0], cols[0]]:.3f} A)"
+        )
+    # + 0.5 in float32 then uint16_t() truncating rounds to nearest
+    return np.clip(raw + np.float32(0.5), 0, DAC_FULL_SCALE).astype(np.uint16)
+
+
+def rampOffsets(deltaCurrents, calibration: Calibration, channels=None):
+    """
+    deltaCurrents: (breakpoints x channels) current offsets in A from the triggered row
+    returns the int16 code offsets CMD_SET_RAMP takes; dcode/dI = 65535 / (5 * gain)
+    """
+    deltaCurrents = np.atleast_2d(np.asarray(deltaCurrents, dtype=np.float64))
+    channels = deltaCurrents.shape[1] if channels is None else channels
+    gain = calibration.gain[:channels].astype(np.float64)
+    offsets = np.rint(deltaCurrents * DAC_FULL_SCALE / (5.0 * gain))
+    if np.abs(offsets).max(initial=0) > WAVE_MAX_OFFSET:
+        raise ShimCodesError(f"ramp offsets exceed {WAVE_MAX_OFFSET} codes")
+    return offsets.astype(np.int16)
+
+
+def decompileCodes(codes, calibration: Calibration):
+    """currents the device will actually drive for a code table, inverse of compileCodes"""
+    codes = np.atleast_2d(np.asarray(codes, dtype=np.float32))
+    channels = codes.shape[1]
+    gain = calibration.gain[:channels]
+    zeroPoint = calibration.zeroPoint[:channels]
+    return (codes * 5.0 / DAC_FULL_SCALE - 2.5 + zeroPoint) * gain
+
+
+class ShimCodesError(Exception):
+    pass
@@ -0,0 +1,159 @@
+"""Buffered logging for the shim client.
+
+The serial threads only put records on a bounded queue; one writer thread
+formats them, writes them in batches and flushes every flushInterval, so file
+I/O never stalls the receive loop. A full queue drops records (and says so in
+the log) rather than blocking the caller.
+
+With binaryPath set, every frame and line crossing the serial port is also
+kept in a compact binary log that readBinaryLog() replays, e.g. through
+frameLatencies() for offline latency analysis:
+    b"SHIMLOG1" then records [u64 t_us][u8 kind][u8 seq][u8 cmd][u32 length][data]
+"""
+
+import queue
+import struct
+import threading
+import time
+from datetime import datetime
+
+LOG_TEXT = 0  # ascii line received, or a note from the client
+LOG_TX_FRAME = 1
+LOG_TX_ASCII = 2
+LOG_TX_RAW = 3  # data holds the u32 byte count, not the stream
+LOG_RX_ACK = 4
+LOG_RX_NAK = 5  # data holds the error code
+LOG_RX_REPLY = 6
+LOG_RX_EVENT = 7
+
+LOG_KINDS = ["text", "txFrame", "txAscii", "txRaw", "ack", "nak", "reply", "event"]
+
+BINARY_MAGIC = b"SHIMLOG1"
+RECORD_HEADER = struct.Struct("<QBBBI")
+
+# wall clock at start, advanced with the performance counter: monotonic and still comparable across runs
+_wallBase = time.time_ns() // 1000
+_perfBase = time.perf_counter_ns() // 1000
+
+
+def nowUs():
+    return _wallBase + time.perf_counter_ns() // 1000 - _perfBase
+
+
+def formatUs(tUs):
+    return datetime.fromtimestamp(tUs / 1e6).strftime("%H:%M:%S.%f")
+
+
+class BufferedLog:
+    def __init__(self, path, binaryPath=None, maxQueue=10000, batch=512, flushInterval=0.1):
+        self.path = path
+        self.binaryPath = binaryPath
+        self.batch = batch
+        self.flushInterval = flushInterval
+        self.queue = queue.Queue(maxsize=maxQueue)
+        self.dropped = 0
+        self.running = True
+
+        # truncate both logs; the writer thread owns the handles from here on
+        self.textFile = open(path, "w")
+        self.binaryFile = None
+        if binaryPath:
+            self.binaryFile = open(binaryPath, "wb")
+            self.binaryFile.write(BINARY_MAGIC)
+
+        self.thread = threading.Thread(target=self.writeLoop)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def put(self, item):
+        try:
+            self.queue.put_nowait(item)
+        except queue.Full:
+            self.dropped += 1
+
+    def write(self, text, timestamp=True):
+        """text log line; timestamp=False writes text as is, like the old writeLog"""
+        self.put((nowUs() if timestamp else None, text))
+
+    def record(self, kind, seq=0, cmd=0, data=b""):
+        """binary log record, a no-op unless binaryPath was given"""
+        if self.binaryFile is not None:
+            self.put((nowUs(), kind, seq, cmd, bytes(data)))
+
+    def writeLoop(self):
+        lastFlush = time.monotonic()
+        reported = 0
+        while self.running or not self.queue.empty():
+            try:
+                items = [self.queue.get(timeout=self.flushInterval)]
+            except queue.Empty:
+                items = []
+            while items and len(items) < self.batch:
+                try:
+                    items.append(self.queue.get_nowait())
+                except queue.Empty:
+                    break
+            text = []
+            for item in items:
+                if len(item) == 2:
+                    tUs, line = item
+                    text.append(line if tUs is None else f"{formatUs(tUs)} {line}\n")
+                else:
+                    tUs, kind, seq, cmd, data = item
+                    self.binaryFile.write(RECORD_HEADER.pack(tUs, kind, seq & 0xFF, cmd & 0xFF, len(data)) + data)
+            if self.dropped != reported:
+                text.append(f"{formatUs(nowUs())} LOG: queue full, {self.dropped - reported} records dropped\n")
+                reported = self.dropped
+            if text:
+                self.textFile.write("".join(text))
+            if time.monotonic() - lastFlush >= self.flushInterval:
+                self.flush()
+                lastFlush = time.monotonic()
+        self.flush()
+
+    def flush(self):
+        self.textFile.flush()
+        if self.binaryFile is not None:
+            self.binaryFile.flush()
+
+    def close(self):
+        """write out everything queued and close the files"""
+        self.running = False
+        self.thread.join()
+        self.textFile.close()
+        if self.binaryFile is not None:
+            self.binaryFile.close()
+
+
+def readBinaryLog(path):
+    """yields (t_us, kind, seq, cmd, data) from a binary log"""
+    with open(path, "rb") as file:
+        if file.read(len(BINARY_MAGIC)) != BINARY_MAGIC:
+            raise ValueError(f"{path} is not a shim binary log")
+        while True:
+            head = file.read(RECORD_HEADER.size)
+            if len(head) < RECORD_HEADER.size:
+                return
+            tUs, kind, seq, cmd, length = RECORD_HEADER.unpack(head)
+            yield tUs, kind, seq, cmd, file.read(length)
+
+
+def frameLatencies(path):
+    """
+    pair every frame sent with the ACK, NAK or reply to its seq.
+    returns [(cmd, seq, latency us, outcome)], outcome one of ack/nak/reply/lost
+    """
+    pending = {}
+    results = []
+    for tUs, kind, seq, cmd, data in readBinaryLog(path):
+        if kind == LOG_TX_FRAME:
+            if seq in pending:
+                # seq reused (or a go-back-N resend) before an answer arrived
+                lost = pending.pop(seq)
+                results.append((lost[1], seq, None, "lost"))
+            pending[seq] = (tUs, cmd)
+        elif kind in (LOG_RX_ACK, LOG_RX_NAK, LOG_RX_REPLY) and seq in pending:
+            sentUs, sentCmd = pending.pop(seq)
+            results.append((sentCmd, seq, tUs - sentUs, LOG_KINDS[kind]))
+    results.extend((cmd, seq, None, "lost") for seq, (_, cmd) in pending.items())
+    return results
@@ -0,0 +1,351 @@
+"""Binary framed protocol spoken by the shim arduino (see src/arduinoCode/protocol.h).
+
+Host -> device frame (little endian):
+    [FRAME_SYNC][len lo][len hi][seq][cmd][payload][crc lo][crc hi]
+The device answers every frame with [FRAME_ACK][seq] or [FRAME_NAK][seq][error],
+except commands that return data, which answer with
+    [FRAME_REPLY][len lo][len hi][seq][cmd][payload][crc lo][crc hi]
+Unsolicited events use the same layout behind FRAME_EVENT, with an EVT_* code as cmd.
+"""
+
+import struct
+from concurrent.futures import Future
+
+FRAME_SYNC = 0xA5
+FRAME_ACK = 0x06
+FRAME_NAK = 0x15
+FRAME_REPLY = 0x02
+FRAME_EVENT = 0x03
+FRAME_MAX_PAYLOAD = 512
+
+CMD_PING = 0x00
+CMD_SET_CURRENTS = 0x01
+CMD_ZERO = 0x02
+CMD_SET_SPI_CLOCK = 0x03
+CMD_SET_ADC_FILTER = 0x04
+CMD_UPLOAD_BEGIN = 0x05
+CMD_UPLOAD_CHUNK = 0x06
+CMD_UPLOAD_END = 0x07
+CMD_TABLE_COMMIT = 0x08
+CMD_SET_TOPOLOGY = 0x09
+CMD_SET_REGULATION = 0x0A
+CMD_SET_BNC = 0x0B
+CMD_GET_STATS = 0x0C
+CMD_SET_TRIGGER = 0x0D
+CMD_UPLOAD_BULK = 0x0E
+CMD_LINK_INFO = 0x0F
+CMD_GET_CALIBRATION = 0x10
+CMD_SET_RAMP = 0x11
+CMD_SET_WAVEFORM = 0x12
+CMD_SET_TELEMETRY = 0x13
+CMD_SET_EMERGENCY = 0x14
+
+EVT_DESYNC = 0x80
+EVT_TRIGGER_LOG = 0x81
+EVT_TELEMETRY = 0x82
+EVT_ZERO = 0x83
+
+TRIGGER_LOG_CODES = 8  # see trigger_record in shim_arduino.ino
+
+# EMERGENCY ZERO in shim_arduino.ino: the reserved byte, and zero_source as reported by EVT_ZERO
+ZERO_BYTE = 0x18
+ZERO_RUN = 16  # inside a frame or upload stream only a run of ZERO_BYTE counts, see protocol.h
+ZERO_STUFF = 0x00  # keeps data from making a run, see stuffZeroRuns
+ZERO_SOURCE = {0: "serial", 1: "pin"}
+
+# trigger_policy in shim_arduino.ino
+TRIGGER_POLICY = {"queue": 0, "skip": 1}
+
+# stat_id order in stats.h
+STAT_NAMES = ["setDACVal", "update_outputs", "LTC2656Send", "LTC1863Read", "waveTick", "update_outputs_main"]
+
+# WAVEFORM limits in util.h
+WAVE_MAX_RAMPS = 4
+WAVE_MAX_POINTS = 8
+WAVE_MAX_OFFSET = 16383
+
+UPLOAD_FLOAT32 = 0
+UPLOAD_CODES = 1
+
+# ADC decimation filters, see adc_filter in hardware.h
+ADC_FILTER = {"boxcar": 0, "median": 1, "trimmed": 2}
+
+# SPI_CLOCK_DIVn codes from t3spi.h, keyed by divider
+SPI_CLOCK_DIV = {2: 0, 4: 1, 6: 2, 8: 3, 16: 4, 32: 5, 64: 6, 128: 7}
+
+FRAME_ERRORS = {
+    0x00: "none",
+    0x01: "crc mismatch",
+    0x02: "bad length",
+    0x03: "timeout",
+    0x04: "unknown command",
+    0x05: "bad argument",
+    0x06: "too big",
+    0x07: "out of sequence",
+}
+
+
+class ShimFrameError(Exception):
+    """A frame was NAKed (or never answered) by the arduino."""
+
+    def __init__(self, frame, err):
+        self.err = err
+        super().__init__(f"{frame} failed: {FRAME_ERRORS.get(err, err)}")
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT (poly 0x1021, init 0xFFFF), matches crc16() in protocol.h"""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def stuffZeroRuns(data):
+    """put a ZERO_STUFF before the next byte after every ZERO_RUN - 1 ZERO_BYTEs in a row,
+    so frame and stream data never reads as an emergency zero; zero_run_unstuff in protocol.h drops them"""
+    data = bytes(data)
+    if bytes([ZERO_BYTE]) * (ZERO_RUN - 1) not in data:
+        return data
+    out = bytearray()
+    run = 0
+    for byte in data:
+        if run == ZERO_RUN - 1:
+            out.append(ZERO_STUFF)
+            run = 0
+        out.append(byte)
+        run = run + 1 if byte == ZERO_BYTE else 0
+    return bytes(out)
+
+
+def buildFrame(seq, cmd, payload=b""):
+    if len(payload) > FRAME_MAX_PAYLOAD:
+        raise ValueError(f"frame payload of {len(payload)} bytes exceeds {FRAME_MAX_PAYLOAD}")
+    body = struct.pack("<HBB", len(payload), seq & 0xFF, cmd) + bytes(payload)
+    return bytes([FRAME_SYNC]) + stuffZeroRuns(body + struct.pack("<H", crc16(body)))
+
+
+def packSetCurrents(entries):
+    """entries: iterable of (board, channel, current) -> CMD_SET_CURRENTS payload"""
+    entries = list(entries)
+    payload = struct.pack("<B", len(entries))
+    for board, channel, current in entries:
+        payload += struct.pack("<BBf", board, channel, current)
+    return payload
+
+
+def packBncTiming(delayUs, widthUs):
+    return struct.pack("<HH", int(delayUs), int(widthUs))
+
+
+def packRegulation(enable, integralGain):
+    if not 0 < integralGain <= 1:
+        raise ValueError("integral gain must be in (0, 1]")
+    return struct.pack("<Bf", int(bool(enable)), integralGain)
+
+
+def packRamp(rampId, points):
+    """points: (ticks, [int code offset per table column]) breakpoints -> CMD_SET_RAMP payload; [] clears"""
+    points = list(points)
+    if not 0 <= rampId < WAVE_MAX_RAMPS or len(points) > WAVE_MAX_POINTS:
+        raise ValueError(f"at most {WAVE_MAX_RAMPS} ramps of {WAVE_MAX_POINTS} breakpoints")
+    payload = struct.pack("<BB", rampId, len(points))
+    for ticks, offsets in points:
+        offsets = [int(o) for o in offsets]
+        if ticks < 1 or any(abs(o) > WAVE_MAX_OFFSET for o in offsets):
+            raise ValueError(f"breakpoints need ticks >= 1 and offsets within +-{WAVE_MAX_OFFSET} codes")
+        payload += struct.pack(f"<H{len(offsets)}h", int(ticks), *offsets)
+    return payload
+
+
+def packWaveform(tickUs, blockRamps):
+    """blockRamps: ramp id or None per table block -> CMD_SET_WAVEFORM payload; tickUs=0 turns waveforms off"""
+    blockRamps = list(blockRamps)
+    ids = [0 if r is None else r + 1 for r in blockRamps]
+    return struct.pack(f"<HB{len(ids)}B", int(tickUs), len(ids), *ids)
+
+
+def packTelemetry(periodMs):
+    """background current monitor round period in ms, 0 turns it off"""
+    if periodMs and periodMs < 2:
+        raise ValueError("telemetry period must be at least 2 ms")
+    return struct.pack("<H", int(periodMs))
+
+
+def packTopology(boards):
+    """boards: iterable of (select address, [dac channels in column order]) -> CMD_SET_TOPOLOGY payload"""
+    boards = list(boards)
+    payload = struct.pack("<B", len(boards))
+    for address, channels in boards:
+        channels = list(channels)
+        payload += struct.pack(f"<BB{len(channels)}B", address, len(channels), *channels)
+    return payload
+
+
+def packUploadBegin(channels, lengths, reps, fmt=UPLOAD_FLOAT32, epoch=None, stored=None, indexSize=1):
+    """
+    epoch: calibration epoch the codes were compiled against, required for UPLOAD_CODES
+    stored: distinct rows of a deduplicated table (see dedupRows), its index entries are indexSize bytes
+    """
+    if len(lengths) != len(reps):
+        raise ValueError("lengths and reps must describe the same blocks")
+    payload = struct.pack("<BBB", fmt, channels, len(lengths))
+    payload += struct.pack(f"<{len(lengths)}H", *lengths)
+    payload += struct.pack(f"<{len(reps)}I", *reps)
+    if fmt == UPLOAD_CODES:
+        payload += struct.pack("<H", epoch)
+    if stored is not None:
+        payload += struct.pack("<HB", stored, indexSize)
+    return payload
+
+
+# struct format and size of one table value per upload format, and of one row index entry per index size
+UPLOAD_VALUE = {UPLOAD_FLOAT32: ("f", 4), UPLOAD_CODES: ("H", 2)}
+UPLOAD_INDEX = {1: ("B", 1), 2: ("H", 2)}
+
+
+def dedupRows(rows):
+    """the distinct rows in order of first use and, per row, its position among them"""
+    stored = []
+    index = []
+    seen = {}
+    for row in rows:
+        key = tuple(row)
+        if key not in seen:
+            seen[key] = len(stored)
+            stored.append(key)
+        index.append(seen[key])
+    return stored, index
+
+
+def indexSizeFor(stored):
+    return 1 if stored <= 256 else 2
+
+
+def packUploadBulk(values, fmt=UPLOAD_FLOAT32, index=(), indexSize=1):
+    """CMD_UPLOAD_BULK payload and the stuffed stream that follows its ACK: the values, then the row index if any"""
+    stream = struct.pack(f"<{len(values)}{UPLOAD_VALUE[fmt][0]}", *values)
+    stream += struct.pack(f"<{len(index)}{UPLOAD_INDEX[indexSize][0]}", *index)
+    return struct.pack("<IH", len(stream), crc16(stream)), stuffZeroRuns(stream)
+
+
+def unpackLinkInfo(payload):
+    usb, baud, maxPayload, bulkBlock = struct.unpack("<BIHH", payload)
+    return {"usb": bool(usb), "baud": baud, "maxPayload": maxPayload, "bulkBlock": bulkBlock}
+
+
+def packUploadChunks(values, fmt=UPLOAD_FLOAT32, index=(), indexSize=1):
+    """split a flat list of table values, then the row index if any, into CMD_UPLOAD_CHUNK payloads"""
+    values = list(values)
+    index = list(index)
+    for start, items, (code, size) in ((0, values, UPLOAD_VALUE[fmt]), (len(values), index, UPLOAD_INDEX[indexSize])):
+        chunkValues = (FRAME_MAX_PAYLOAD - 2) // size
+        for offset in range(0, len(items), chunkValues):
+            chunk = items[offset : offset + chunkValues]
+            yield struct.pack("<H", start + offset) + struct.pack(f"<{len(chunk)}{code}", *chunk)
+
+
+def unpackStats(payload):
+    """decode a CMD_GET_STATS reply (see stats_pack in stats.h); times in microseconds"""
+    fCpu, triggers, overruns, spiTx, spiRx, adcTimeouts, nStats, nBins = struct.unpack_from("<6IBB", payload)
+    perUs = fCpu / 1e6
+    stats = {
+        "triggers": triggers,
+        "overruns": overruns,
+        "spiWordsTx": spiTx,
+        "spiWordsRx": spiRx,
+        "adcTimeouts": adcTimeouts,
+    }
+    offset = struct.calcsize("<6IBB")
+    for i in range(nStats):
+        count, lo, hi, mean = struct.unpack_from("<4I", payload, offset)
+        hist = list(struct.unpack_from(f"<{nBins}I", payload, offset + 16))
+        offset += 16 + 4 * nBins
+        name = STAT_NAMES[i] if i < len(STAT_NAMES) else f"stat{i}"
+        stats[name] = {
+            "count": count,
+            "minUs": lo / perUs,
+            "maxUs": hi / perUs,
+            "meanUs": mean / perUs,
+            # bin 0 is < 1us, bin k is [2^(k-1), 2^k) us
+            "histogram": hist,
+        }
+    if len(payload) >= offset + 4:
+        (stats["waveSkips"],) = struct.unpack_from("<I", payload, offset)
+    return stats
+
+
+def unpackDesync(payload):
+    edge, late, action, events = struct.unpack("<IHBI", payload)
+    return {"edge": edge, "lateRows": late, "action": "skipped" if action else "queued", "events": events}
+
+
+def unpackZero(payload):
+    source, count = struct.unpack("<BI", payload)
+    return {"source": ZERO_SOURCE.get(source, source), "count": count}
+
+
+def unpackTriggerLog(payload):
+    """decode an EVT_TRIGGER_LOG batch -> (records dropped on the device so far, [records])"""
+    n, dropped = struct.unpack_from("<BI", payload)
+    fmt = f"<IiHH{TRIGGER_LOG_CODES}H"
+    size = struct.calcsize(fmt)
+    records = []
+    for i in range(n):
+        cycles, counter, blk, rep, *codes = struct.unpack_from(fmt, payload, 5 + i * size)
+        records.append({"cycles": cycles, "counter": counter, "blk": blk, "rep": rep, "codes": codes})
+    return dropped, records
+
+
+# NAKs worth sending again; ERR_SEQUENCE only means a lost chunk inside an upload
+RETRYABLE_ERRORS = (0x01, 0x03)
+UPLOAD_RESTART_ERRORS = RETRYABLE_ERRORS + (0x07,)
+# a second copy of these is not harmless (UPLOAD_BEGIN drops the rows already in, the stream after
+# UPLOAD_BULK swallows whatever follows, UPLOAD_END reads its bulk result once, TABLE_COMMIT NAKs
+# ERR_SEQUENCE once the first swapped, SET_TOPOLOGY drops the loaded table): never sent again,
+# an upload starts over from UPLOAD_BEGIN instead. The other commands set absolute state and
+# go-back-N resends in order, so running them twice ends where the host asked
+UNREPEATABLE_CMDS = (CMD_UPLOAD_BEGIN, CMD_UPLOAD_BULK, CMD_UPLOAD_END, CMD_TABLE_COMMIT, CMD_SET_TOPOLOGY)
+BULK_TIMEOUT = 0.5  # BULK_TIMEOUT_MS in util.h, a stalled stream has been dropped after it
+
+
+class Frame:
+    """A binary command waiting in the shim client's queue.
+    future resolves to True on ACK, to the payload of a FRAME_REPLY, or raises ShimFrameError on NAK."""
+
+    def __init__(self, cmd, payload=b"", onAck=None, onReply=None):
+        self.cmd = cmd
+        self.payload = payload
+        self.onAck = onAck
+        self.onReply = onReply
+        self.seq = None
+        self.future = Future()
+        self.sentAt = None
+        self.retries = 0
+
+    def retryable(self, err):
+        return err in RETRYABLE_ERRORS or (err == 0x07 and self.cmd == CMD_UPLOAD_CHUNK)
+
+    def repeatable(self):
+        return self.cmd not in UNREPEATABLE_CMDS
+
+    def encode(self, seq):
+        self.seq = seq & 0xFF
+        return buildFrame(self.seq, self.cmd, self.payload)
+
+    def __str__(self):
+        return f"Frame(cmd=0x{self.cmd:02x}, seq={self.seq}, {len(self.payload)} bytes)"
+
+
+class RawStream:
+    """Untagged bytes written once `after` (the frame announcing them) has been ACKed.
+    Dropped if that frame failed, so the arduino never parses them as commands."""
+
+    def __init__(self, data, after):
+        self.data = data
+        self.after = after
+
+    def __str__(self):
+        return f"RawStream({len(self.data)} bytes after {self.after})"
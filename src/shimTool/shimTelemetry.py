@@ -0,0 +1,95 @@
+"""Background current monitoring stream of the shim arduino (see TELEMETRY in util.h).
+
+The firmware sends one EVT_TELEMETRY frame per round of ADC sweeps:
+    [u32 us][u16 seq][n columns][u16 adc x n]
+with raw LTC1863 codes, 0xFFFF where a sweep timed out. CurrentMonitor turns
+them into amps and keeps a rolling window that the gui can read at its own
+rate, decimated to the number of points it actually draws.
+"""
+
+import struct
+import threading
+import warnings
+
+import numpy as np
+
+TELEMETRY_MISSING = 0xFFFF
+
+
+def adcToCurrent(adc):
+    """computeOutI in util.h: 12 bit code -> amps, NaN where the reading is missing"""
+    adc = np.asarray(adc, dtype=np.float64)
+    current = ((adc * 4.096 / 4096.0) - 1.25) / 10 / 0.2
+    current[adc == TELEMETRY_MISSING] = np.nan
+    return current
+
+
+def unpackTelemetry(payload):
+    """decode one EVT_TELEMETRY payload -> (device us, seq, currents per column)"""
+    us, seq, columns = struct.unpack_from("<IHB", payload)
+    adc = np.frombuffer(payload, dtype="<u2", count=columns, offset=7)
+    return us, seq, adcToCurrent(adc)
+
+
+class CurrentMonitor:
+    """Rolling window of telemetry rounds, filled by the shim client's read thread."""
+
+    def __init__(self, length=4096):
+        self.length = length
+        self.lock = threading.Lock()
+        self.clear()
+
+    def clear(self):
+        with self.lock:
+            self.times = np.full(self.length, np.nan)
+            self.currents = None
+            self.count = 0
+            self.lastSeq = None
+            self.lost = 0
+            self.wraps = 0
+            self.lastUs = None
+
+    def add(self, us, seq, currents):
+        with self.lock:
+            if self.currents is None or self.currents.shape[1] != len(currents):
+                self.currents = np.full((self.length, len(currents)), np.nan)
+                self.count = 0
+            if self.lastSeq is not None:
+                self.lost += (seq - self.lastSeq - 1) & 0xFFFF
+            self.lastSeq = seq
+            # micros() wraps every ~71 minutes
+            if self.lastUs is not None and us < self.lastUs:
+                self.wraps += 1
+            self.lastUs = us
+            i = self.count % self.length
+            self.times[i] = (us + self.wraps * 2**32) * 1e-6
+            self.currents[i] = currents
+            self.count += 1
+
+    def snapshot(self, points=None):
+        """
+        (times in s, currents [samples x columns]) oldest first.
+        points: decimate by block mean to at most this many samples, for display
+        """
+        with self.lock:
+            if self.currents is None or self.count == 0:
+                return np.empty(0), np.empty((0, 0))
+            n = min(self.count, self.length)
+            order = (np.arange(n) + self.count - n) % self.length
+            times = self.times[order]
+            currents = self.currents[order]
+        if points is not None and n > points:
+            factor = -(-n // points)
+            keep = (n // factor) * factor
+            times = times[n - keep :].reshape(-1, factor).mean(axis=1)
+            with warnings.catch_warnings():
+                warnings.simplefilter("ignore", RuntimeWarning)  # columns that are all missing
+                currents = np.nanmean(currents[n - keep :].reshape(-1, factor, currents.shape[1]), axis=1)
+        return times, currents
+
+    def latest(self):
+        """currents of the newest round, or None"""
+        with self.lock:
+            if self.count == 0:
+                return None
+            return self.currents[(self.count - 1) % self.length].copy()
@@ -1,10 +1,17 @@
+import json
 import queue
 import re
+import struct
 import threading
-from datetime import datetime
+import time
+from collections import OrderedDict, deque
 
 import serial
 
+from shimTool.shimCodes import *
+from shimTool.shimLogger import *
+from shimTool.shimProtocol import *
+from shimTool.shimTelemetry import CurrentMonitor, unpackTelemetry
 from shimTool.utils import launchInThread
 
 
@@ -13,6 +20,8 @@ class shim:
         self.debugging = debugging
         self.port = config["shimPort"]
         self.baudRate = config["shimBaudRate"]
+        # "binary" uses the framed protocol for current setting; "ascii" falls back to the X b c float commands
+        self.binaryProtocol = config.get("shimProtocol", "binary") == "binary"
         self.outputFile = outputFile
         self.defaultTimeout = defaultTimeout
 
@@ -23,6 +32,26 @@ class shim:
         self.readThread = None
         self.running = None
         self.lastCommand = ""
+        self.seq = 0
+        # binary frames are pipelined: up to `window` in flight, keyed by seq in send order
+        self.window = config.get("shimWindow", 8)
+        self.frameTimeout = 1
+        self.maxRetries = 3
+        # bumped by shimEmergencyZero, an upload it cut short is not started over
+        self.emergencyZeroes = 0
+        self.inFlight = OrderedDict()
+        self.flightLock = threading.Condition()
+        self.stats = {}
+        self.linkInfo = {}
+        self.calibration = None
+        self.desyncEvents = []
+        # rows played, as reported by the firmware's trigger log
+        self.triggerLog = deque(maxlen=4096)
+        self.triggerLogDropped = 0
+        # background current monitor, see shimSetTelemetry
+        self.telemetry = CurrentMonitor(config.get("shimTelemetryLength", 4096))
+        # results of the last 'B' firmware benchmark, one dict per BENCH line
+        self.benchmark = []
 
         # TODO: add a way to set the num loops and update the arduino code to accept those changes
         self.numLoops = 0
@@ -32,9 +61,8 @@ class shim:
         # this gets set in the Exsi Gui
         self.clearExsiQueue = lambda: None
 
-        # Clear the Log
-        with open(self.outputFile, "w"):
-            pass
+        # Clear the Log; written from its own thread, optionally with a binary replay log beside it
+        self.log = BufferedLog(self.outputFile, binaryPath=config.get("shimBinaryLog"))
 
         # Init the connection
         try:
@@ -48,7 +76,8 @@ class shim:
 
         # startup procedure to show when connected
         def waitForConnection():
-            self.send("C")
+            # calibration is kept in the arduino's EEPROM, only drifted channels are redone
+            self.send("K")
             if not self.readyEvent.is_set():
                 self.readyEvent.wait()
             self.connectedEvent.set()
@@ -81,18 +110,40 @@ class shim:
                 try:
                     # Wait for up to 1 second
                     cmd = self.commandQueue.get(timeout=1)
+                except queue.Empty:
+                    # Go back to the start of the loop to check self.running again
+                    self.checkFrameTimeouts()
+                    continue
+                if isinstance(cmd, Frame):
+                    # frames only wait for a free slot in the window
+                    with self.flightLock:
+                        while self.running and len(self.inFlight) >= self.window:
+                            self.flightLock.wait(0.05)
+                            self.checkFrameTimeouts()
+                        self._sendCommand(cmd)
+                elif isinstance(cmd, RawStream):
+                    with self.flightLock:
+                        while self.running and self.inFlight:
+                            self.flightLock.wait(0.05)
+                            self.checkFrameTimeouts()
+                    if cmd.after.future.done() and cmd.after.future.exception() is None:
+                        self.log.record(LOG_TX_RAW, data=struct.pack("<I", len(cmd.data)))
+                        self.ser.write(cmd.data)
+                else:
+                    # ascii replies are not tagged, so the pipeline is drained first
+                    with self.flightLock:
+                        while self.running and self.inFlight:
+                            self.flightLock.wait(0.05)
+                            self.checkFrameTimeouts()
                     self._sendCommand(cmd)
                     # the arduino should be able to send a response immediately
                     ready = self.readyEvent.wait(1)
                     if not ready:
                         self.stop()
                         raise TimeoutError(f"Error: Command {cmd} send to Shim Arduino. No valid responce recv.")
-                    # Response was recieved, clear the event and pop cmd from queue
+                    # Response was recieved, clear the event
                     self.readyEvent.clear()
-                    self.commandQueue.task_done()
-                except queue.Empty:
-                    # Go back to the start of the loop to check self.running again
-                    continue
+                self.commandQueue.task_done()
 
         self.command_processor_thread = threading.Thread(target=processCommands)
         self.command_processor_thread.daemon = True
@@ -102,18 +153,23 @@ class shim:
         try:
             while self.running:
                 if self.ser.inWaiting() > 0:
-                    msg = self.ser.readline().decode("utf-8").rstrip()
+                    first = self.ser.read(1)
+                    if first[0] in (FRAME_ACK, FRAME_NAK):
+                        # binary reply to a frame; never part of an ascii line
+                        msg, ready, fail = self.processFrameReply(first[0])
+                    elif first[0] in (FRAME_REPLY, FRAME_EVENT):
+                        msg, ready, fail = self.processFrameData(first[0])
+                    else:
+                        line = first if first == b"\n" else first + self.ser.readline()
+                        msg = line.decode("utf-8", errors="replace").rstrip()
+                        self.log.record(LOG_TEXT, data=line)
+                        ready, fail = self.processLine(msg)
                     if self.debugging:
                         print(f"Debug SHIM CLIENT: recieved msg: {msg}")
 
                     # Append the message that was recieved to the log
-                    with open(self.outputFile, "a") as file:
-                        current_time = datetime.now()
-                        # Format the current time as a string (e.g., HH:MM:SS)
-                        formatted_time = current_time.strftime("%H:%M:%S")
-                        file.write(f"{formatted_time} Received: " + msg + "\n")
-
-                    ready, fail = self.processLine(msg)
+                    if msg is not None:
+                        self.writeLog(f"Received: {msg}")
 
                     # if response indicates self.lastCommand successfully completed,
                     # free the command Process thread to issue next command
@@ -122,24 +178,131 @@ class shim:
                     # if failure condition met, clear the command queue, and ready for more
                     if fail:
                         notify = "Command Failed: "
-                        notify += self.lastCommand
+                        notify += str(self.lastCommand)
                         notify += "\nClearing Command Queue\n\n"
-                        with open(self.outputFile, "a") as file:
-                            file.write(notify)
+                        self.writeLog(notify, timestamp=False)
                         self.clearCommandQueue()  # Clear the queue on failure
                         self.clearExsiQueue()
         except Exception as e:
             print(f"Debug SHIM CLIENT: Error while reading from serial port: {e}")
 
+    def writeLog(self, text, timestamp=True):
+        # queued, the logger thread stamps, batches and flushes
+        self.log.write(text, timestamp)
+
+    def processFrameReply(self, kind):
+        """Read the rest of an ACK/NAK and match it against the frames in flight"""
+        seq = self.ser.read(1)[0]
+        err = self.ser.read(1)[0] if kind == FRAME_NAK else 0
+        self.log.record(LOG_RX_ACK if kind == FRAME_ACK else LOG_RX_NAK, seq, data=bytes([err]) if err else b"")
+        if kind == FRAME_ACK:
+            return self.completeFrame(seq, True)
+        return self.completeFrame(seq, None, err)
+
+    def completeFrame(self, seq, result, err=0):
+        """Resolve the frame tagged seq; returns (msg, ready, fail) like processLine"""
+        with self.flightLock:
+            frame = self.inFlight.pop(seq, None)
+            if frame is None:
+                # stale reply, e.g. to a frame that already timed out or was sent again
+                return f"unexpected reply seq {seq}", False, False
+            if result is None and frame.retryable(err) and frame.retries < self.maxRetries and self.canGoBack(frame):
+                self.goBack(frame)
+                return f"NAK seq {seq}: {FRAME_ERRORS.get(err, err)}, sending again", False, False
+            self.flightLock.notify_all()
+        if result is None:
+            frame.future.set_exception(ShimFrameError(frame, err))
+            return f"NAK seq {seq}: {FRAME_ERRORS.get(err, err)}", False, True
+        if frame.onAck is not None:
+            frame.onAck()
+        if frame.onReply is not None and result is not True:
+            frame.onReply(result)
+        frame.future.set_result(result)
+        return f"{'ACK' if result is True else 'reply'} seq {seq}", False, False
+
+    def canGoBack(self, frame):
+        """go-back-N resends frame and everything after it, so none of them may change state twice"""
+        return frame.repeatable() and all(f.repeatable() for f in self.inFlight.values())
+
+    def goBack(self, frame):
+        """go-back-N: send frame again, followed by every frame that went out after it.
+        Replies to their old seqs no longer match and are dropped. Call with flightLock held."""
+        later = list(self.inFlight.values())
+        self.inFlight.clear()
+        for f in [frame] + later:
+            f.retries += 1
+            self._sendCommand(f)
+
+    def checkFrameTimeouts(self):
+        with self.flightLock:
+            if not self.inFlight:
+                return
+            oldest = next(iter(self.inFlight.values()))
+            if time.monotonic() - oldest.sentAt < self.frameTimeout:
+                return
+            self.inFlight.pop(oldest.seq)
+            if oldest.retries < self.maxRetries and self.canGoBack(oldest):
+                self.writeLog(f"Timeout: {oldest}, sending again")
+                self.goBack(oldest)
+                return
+            frames = [oldest] + list(self.inFlight.values())
+            self.inFlight.clear()
+            self.flightLock.notify_all()
+        for f in frames:
+            f.future.set_exception(ShimFrameError(f, 0x03))
+        self.writeLog(f"Timeout: {oldest} never answered", timestamp=True)
+        self.clearCommandQueue()
+        self.clearExsiQueue()
+
+    def processFrameData(self, kind):
+        """Read a FRAME_REPLY and hand its payload to the frame in flight, or handle a FRAME_EVENT"""
+        head = self.ser.read(4)
+        length, seq, cmd = struct.unpack("<HBB", head)
+        payload = self.ser.read(length)
+        crc = struct.unpack("<H", self.ser.read(2))[0]
+        if crc != crc16(head + payload):
+            return f"reply seq {seq} failed its crc", False, False
+        self.log.record(LOG_RX_EVENT if kind == FRAME_EVENT else LOG_RX_REPLY, seq, cmd, payload)
+        if kind == FRAME_EVENT:
+            # asynchronous, never completes the command in flight
+            return self.processEvent(cmd, payload), False, False
+        return self.completeFrame(seq, payload)
+
+    def processEvent(self, evt, payload):
+        if evt == EVT_DESYNC:
+            event = unpackDesync(payload)
+            self.desyncEvents.append(event)
+            print(f"WARNING SHIM CLIENT: trigger desync, {event['lateRows']} rows {event['action']} at edge {event['edge']}")
+            return f"Event: trigger desync {event}"
+        if evt == EVT_ZERO:
+            event = unpackZero(payload)
+            print(f"WARNING SHIM CLIENT: emergency zero from the {event['source']}, trigger disarmed")
+            return f"Event: emergency zero {event}"
+        if evt == EVT_TELEMETRY:
+            self.telemetry.add(*unpackTelemetry(payload))
+            return None  # too frequent for the log
+        if evt == EVT_TRIGGER_LOG:
+            dropped, records = unpackTriggerLog(payload)
+            if dropped != self.triggerLogDropped:
+                print(f"WARNING SHIM CLIENT: firmware trigger log dropped {dropped - self.triggerLogDropped} records")
+                self.triggerLogDropped = dropped
+            self.triggerLog.extend(records)
+            last = records[-1] if records else {}
+            return f"Event: {len(records)} triggers, last counter {last.get('counter')} blk {last.get('blk')} rep {last.get('rep')}"
+        return f"Event: unknown 0x{evt:02x}, {len(payload)} bytes"
+
     def processLine(self, msg):
         ready = False
         fail = False
 
-        if self.lastCommand.startswith("I"):
+        if isinstance(self.lastCommand, Frame):
+            # ascii chatter while frames are in flight; completion comes from their replies
+            pass
+        elif self.lastCommand.startswith("I"):
             fail = "X" in msg
             ready = "Done Printing Currents" in msg
             # TODO(rob): update the loop currents here too whenever this is run.
-        elif self.lastCommand.startswith("C"):
+        elif self.lastCommand.startswith("C") or self.lastCommand.startswith("K"):
             ready = "Done Calibrating" in msg
             if ready:
                 self.calibrated = True
@@ -171,6 +334,10 @@ class shim:
                     # TODO(rob): maybe add some error bounds checking for indexing this guy
                     # maybe some helper method or smth. get and set methods
                     self.loopCurrents[board * 8 + channel] = current
+        elif self.lastCommand.startswith("B"):
+            if msg.startswith("BENCH "):
+                self.benchmark.append(json.loads(msg[len("BENCH ") :]))
+            ready = "Done Benchmark" in msg
         elif self.lastCommand.startswith("Z"):
             ready = "Done Zeroing" in msg
             # TODO(rob): doesnt detect failure. think about it... maybe not it is so trivial
@@ -185,29 +352,42 @@ class shim:
         return ready, fail
 
     def send(self, cmd, immediate=False):
+        """queue cmd; for a Frame returns its future"""
         if immediate:
             # For immediate commands, that maybe are good to launch on init
             self._sendCommand(cmd)
         else:
             # Else, queue up the command so they can be sent in order.
             self.commandQueue.put(cmd)
+        return cmd.future if isinstance(cmd, Frame) else None
 
     def _sendCommand(self, cmd):
         if cmd is not None:
             self.lastCommand = cmd
-            self.readyEvent.clear()
-            self.ser.write(cmd.encode())
+            if isinstance(cmd, Frame):
+                with self.flightLock:
+                    self.seq = (self.seq + 1) & 0xFF
+                    data = cmd.encode(self.seq)
+                    cmd.sentAt = time.monotonic()
+                    self.inFlight[cmd.seq] = cmd
+                self.log.record(LOG_TX_FRAME, cmd.seq, cmd.cmd, cmd.payload)
+                self.ser.write(data)
+            else:
+                self.readyEvent.clear()
+                self.log.record(LOG_TX_ASCII, data=cmd.encode())
+                self.ser.write(cmd.encode())
 
     def clearCommandQueue(self):
         while not self.commandQueue.empty():
             try:
                 cmd = self.commandQueue.get_nowait()
                 print(f"SHIM CLIENT Debug: Clearing command: {cmd}")
+                if isinstance(cmd, Frame):
+                    cmd.future.cancel()
                 self.commandQueue.task_done()
             except queue.Empty:
                 break
-        with open(self.outputFile, "a") as file:
-            file.write("\n CMD Queue CLEARED due to failure.")
+        self.writeLog("\n CMD Queue CLEARED due to failure.", timestamp=False)
 
     def stop(self):
         # print out the command queue if it was not empty
@@ -221,6 +401,7 @@ class shim:
         if self.ser:
             self.ser.close()
             print(f"INFO SHIM CLIENT: Closed connection to arduino. bye.")
+        self.log.close()
 
     def __del__(self):
         self.stop()
@@ -235,7 +416,7 @@ class shim:
             if not self.connectedEvent.is_set() and not self.debugging:
                 # Show a message to the user, reconnect shim client.
                 raise ShimDriverError("SHIM Client Not Connected")
-            return func(self)
+            return func(self, *args, **kwargs)
 
         return wrapper
 
@@ -247,7 +428,30 @@ class shim:
     @launchInThread
     @requireShimDriverConnected
     def shimZero(self):
-        self.send("Z")
+        if self.binaryProtocol:
+            self.send(Frame(CMD_ZERO))
+        else:
+            self.send("Z")
+
+    @requireShimDriverConnected
+    def shimEmergencyZero(self):
+        """
+        zero every coil now and disarm the trigger, ahead of anything queued (which is dropped).
+        sent as a run that also cuts into a frame or upload; the arduino then ignores the rest of what
+        was on the way for BULK_TIMEOUT. wire and enable its emergency pin for a zero that never waits
+        """
+        self.emergencyZeroes += 1
+        self.clearCommandQueue()
+        self.log.record(LOG_TX_ASCII, data=bytes([ZERO_BYTE]) * ZERO_RUN)
+        self.ser.write(bytes([ZERO_BYTE]) * ZERO_RUN)
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetEmergencyPin(self, enable=True):
+        """zero on a switch to ground at the arduino's emergency pin (pulled up inside); kept across resets"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("the emergency pin setting needs the binary protocol")
+        self.send(Frame(CMD_SET_EMERGENCY, bytes([int(bool(enable))])))
 
     @launchInThread
     @requireShimDriverConnected
@@ -265,7 +469,254 @@ class shim:
     @requireShimDriverConnected
     def shimSetCurrentManual(self, channel, current):
         """helper function to set the current for a specific channel on a specific board."""
-        self.send(f"X {channel // 8} {channel % 8} {current}")
+        if self.binaryProtocol:
+            self.sendCurrents([(channel, current)])
+        else:
+            self.send(f"X {channel // 8} {channel % 8} {current}")
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetCurrents(self, currents):
+        """set several channels in one frame; currents is a list of (channel, current)"""
+        if self.binaryProtocol:
+            self.sendCurrents(currents)
+        else:
+            for channel, current in currents:
+                self.send(f"X {channel // 8} {channel % 8} {current}")
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetSpiClocks(self, dacDivider, adcDivider):
+        """retune the DAC and ADC SPI clocks (bus clock dividers, e.g. 4 and 16) without reflashing"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("SPI clock tuning needs the binary protocol")
+        payload = bytes([SPI_CLOCK_DIV[dacDivider], SPI_CLOCK_DIV[adcDivider]])
+        self.send(Frame(CMD_SET_SPI_CLOCK, payload))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetAdcFilter(self, filter="trimmed", count=0):
+        """choose how oversampled ADC reads are decimated; count=0 lets each firmware caller pick"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("ADC filter tuning needs the binary protocol")
+        self.send(Frame(CMD_SET_ADC_FILTER, bytes([ADC_FILTER[filter], count])))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetBncPulse(self, delayUs=0, widthUs=13):
+        """sync pulse timing relative to the DAC latch on every trigger; widthUs=0 turns it off"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("BNC timing needs the binary protocol")
+        self.send(Frame(CMD_SET_BNC, packBncTiming(delayUs, widthUs)))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetRamp(self, rampId, points, currents=True):
+        """
+        define a sub-TR ramp: (ticks, [offset per table column]) breakpoints, linear in between,
+        offsets from the row the trigger wrote. currents=True takes them in A and converts them
+        with the device calibration, otherwise they are DAC codes. Only while the trigger is halted
+        """
+        if not self.binaryProtocol:
+            raise ShimDriverError("waveforms need the binary protocol")
+        points = list(points)
+        if currents and points:
+            offsets = rampOffsets([o for _, o in points], self.calibration or self.fetchCalibration())
+            points = [(ticks, row) for (ticks, _), row in zip(points, offsets)]
+        self.send(Frame(CMD_SET_RAMP, packRamp(rampId, points)))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetWaveform(self, tickUs, blockRamps):
+        """play ramp blockRamps[b] (None = static) after every row of table block b, one step per tickUs"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("waveforms need the binary protocol")
+        self.send(Frame(CMD_SET_WAVEFORM, packWaveform(tickUs, blockRamps)))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetRegulation(self, enable, integralGain=0.2):
+        """closed loop current regulation from the ADC readback, active while the trigger is armed"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("current regulation needs the binary protocol")
+        self.send(Frame(CMD_SET_REGULATION, packRegulation(enable, integralGain)))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetTopology(self, boards):
+        """
+        describe the coil array to the arduino without reflashing.
+        boards: (select address, [dac channels]) per board, in table column order
+        the arduino drops its loaded tables, upload again afterwards
+        """
+        if not self.binaryProtocol:
+            raise ShimDriverError("topology changes need the binary protocol")
+        self.send(Frame(CMD_SET_TOPOLOGY, packTopology(boards)))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimUploadTable(self, rows, lengths, reps, hold=False, bulk=True, dedup=True):
+        """
+        stream a shim table to the arduino without blocking its main loop.
+        rows: one list of channel currents (A) per table row, blocks stacked in order
+        lengths / reps: rows and repetitions of every block
+        hold: keep the table in the inactive bank until shimCommitTable, e.g. to preload the next series
+        bulk: send the values as one raw USB bulk stream instead of acknowledged chunks
+        dedup: store rows that repeat (the same slices in every block) once on the device and play them through an index
+        """
+        if not self.binaryProtocol:
+            raise ShimDriverError("streaming upload needs the binary protocol")
+        rows = [list(row) for row in rows]
+        if len(rows) != sum(lengths):
+            raise ShimDriverError(f"table has {len(rows)} rows, header describes {sum(lengths)}")
+        self.runUpload(rows, lengths, reps, hold, bulk, dedup=dedup)
+
+    def runUpload(self, *args, **kwargs):
+        """queueUpload and wait for it (blocks, call from a worker thread). A lost frame or reply fails
+        the upload, as its UPLOAD_BEGIN/UPLOAD_BULK/UPLOAD_END are never sent twice; it then starts over"""
+        zeroes = self.emergencyZeroes
+        for attempt in range(self.maxRetries + 1):
+            try:
+                for frame in self.queueUpload(*args, **kwargs):
+                    frame.future.result()
+                return
+            except ShimFrameError as e:
+                if e.err not in UPLOAD_RESTART_ERRORS or attempt == self.maxRetries or self.emergencyZeroes != zeroes:
+                    raise
+                self.writeLog(f"Upload: {e}, starting over")
+            # a device that took the UPLOAD_BULK gives up on the stream first
+            time.sleep(BULK_TIMEOUT)
+
+    def queueUpload(self, rows, lengths, reps, hold, bulk, fmt=UPLOAD_FLOAT32, epoch=None, dedup=True):
+        """queue the frames of one table upload; returns them in order, UPLOAD_END last"""
+        channels = len(rows[0])
+        size = UPLOAD_VALUE[fmt][1]
+        stored, index = dedupRows(rows) if dedup else (rows, [])
+        indexSize = indexSizeFor(len(stored))
+        # the index costs a few bytes per row, only worth it when enough rows repeat
+        if len(stored) * channels * size + len(index) * indexSize >= len(rows) * channels * size:
+            stored, index = rows, []
+        else:
+            self.writeLog(f"Upload: {len(stored)} distinct rows of {len(rows)}")
+        values = [v for row in stored for v in row]
+        begin = packUploadBegin(channels, lengths, reps, fmt, epoch, len(stored) if index else None, indexSize)
+        frames = [Frame(CMD_UPLOAD_BEGIN, begin)]
+        self.send(frames[0])
+        if bulk:
+            header, stream = packUploadBulk(values, fmt, index, indexSize)
+            frames.append(Frame(CMD_UPLOAD_BULK, header))
+            self.send(frames[-1])
+            self.send(RawStream(stream, after=frames[-1]))
+        else:
+            for payload in packUploadChunks(values, fmt, index, indexSize):
+                frames.append(Frame(CMD_UPLOAD_CHUNK, payload))
+                self.send(frames[-1])
+        # reports a bulk stream that arrived damaged
+        frames.append(Frame(CMD_UPLOAD_END, bytes([1]) if hold else b""))
+        self.send(frames[-1])
+        return frames
+
+    def fetchCalibration(self, timeout=5):
+        """read the device calibration page by page into self.calibration (blocks, call from a worker thread)"""
+        pages = []
+        first = 0
+        while True:
+            payload = self.send(Frame(CMD_GET_CALIBRATION, bytes([first]))).result(timeout)
+            page = unpackCalibrationPage(payload)
+            pages.append(page)
+            _, total, first, entries = page
+            first += len(entries)
+            if first >= total or not entries:
+                break
+        self.calibration = joinCalibrationPages(pages)
+        self.writeLog(f"Calibration: epoch {self.calibration.epoch}, {len(self.calibration)} columns")
+        return self.calibration
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimUploadCodes(self, currents, lengths, reps, hold=False, bulk=True, dedup=True):
+        """
+        like shimUploadTable, but the currents (rows x channels) are compiled to DAC codes here
+        against the device's calibration, and a saturating solution is refused before anything is sent
+        """
+        if not self.binaryProtocol:
+            raise ShimDriverError("compiled tables need the binary protocol")
+        codes = compileCodes(currents, self.fetchCalibration())
+        if codes.shape[0] != sum(lengths):
+            raise ShimDriverError(f"table has {codes.shape[0]} rows, header describes {sum(lengths)}")
+        # a calibration between fetch and upload bumps the epoch and UPLOAD_BEGIN is NAKed
+        self.runUpload(codes.tolist(), lengths, reps, hold, bulk, UPLOAD_CODES, self.calibration.epoch, dedup)
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimCommitTable(self):
+        """swap in a table uploaded with hold=True; takes effect at the next trigger when armed"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("table banks need the binary protocol")
+        self.send(Frame(CMD_TABLE_COMMIT))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetTriggerPolicy(self, policy="queue", maxQueue=4):
+        """what the arduino does with edges that arrive before the last row was written:
+        "queue" plays the late rows back to back (up to maxQueue), "skip" jumps to the current row"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("trigger policy needs the binary protocol")
+        self.send(Frame(CMD_SET_TRIGGER, bytes([TRIGGER_POLICY[policy], maxQueue])))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimGetLinkInfo(self):
+        """ask the arduino how it is connected (native USB or UART) into self.linkInfo"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("link info needs the binary protocol")
+
+        def record(payload):
+            self.linkInfo = unpackLinkInfo(payload)
+            self.writeLog(f"Link: {self.linkInfo}")
+
+        self.send(Frame(CMD_LINK_INFO, onReply=record))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimSetTelemetry(self, periodMs=20):
+        """stream every channel's current from the ADC every periodMs into self.telemetry; 0 stops it"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("telemetry needs the binary protocol")
+        if periodMs:
+            self.telemetry.clear()
+        self.send(Frame(CMD_SET_TELEMETRY, packTelemetry(periodMs)))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimGetStats(self, reset=False):
+        """fetch the firmware's timing and trigger counters into self.stats"""
+        if not self.binaryProtocol:
+            raise ShimDriverError("statistics need the binary protocol")
+
+        def record(payload):
+            self.stats = unpackStats(payload)
+            self.writeLog(f"Stats: {self.stats}")
+
+        self.send(Frame(CMD_GET_STATS, bytes([1]) if reset else b"", onReply=record))
+
+    @launchInThread
+    @requireShimDriverConnected
+    def shimBenchmark(self):
+        """run the firmware benchmark (trigger halted) into self.benchmark"""
+        self.benchmark = []
+        self.send("B")
+
+    def sendCurrents(self, currents):
+        currents = list(currents)
+
+        def record():
+            for channel, current in currents:
+                if channel < len(self.loopCurrents):
+                    self.loopCurrents[channel] = current
+
+        payload = packSetCurrents((channel // 8, channel % 8, current) for channel, current in currents)
+        self.send(Frame(CMD_SET_CURRENTS, payload, onAck=record))
 
 
 class ShimDriverError(Exception):